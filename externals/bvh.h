@@ -2,35 +2,21 @@
 
 #pragma once
 
-struct BBox;
-struct Object;
-
-struct IntersectionInfo {
-    float t, u, v; // Intersection distance along the ray
-    const Object* object; // Object that was hit
-};
-
-struct Object {
-    //! All "Objects" must be able to test for intersections with rays.
-    virtual bool getIntersection(const TinyRender::Ray& ray, IntersectionInfo* intersection) const = 0;
-
-    //! Return an object normal based on an intersection
-    virtual v3f getNormal(const IntersectionInfo& I) const = 0;
-
-    //! Return a bounding box for this object
-    virtual BBox getBBox() const = 0;
-
-    //! Return the centroid for this object. (Used in BVH Sorting)
-    virtual v3f getCentroid() const = 0;
-};
-
 struct BBox {
-    v3f min, max, extent;
+    v3f min, max;
     BBox() { }
-    BBox(const v3f& min_, const v3f& max_) : min(min_), max(max_) { extent = max - min; }
-    BBox(const v3f& p) : min(p), max(p) { extent = max - min; }
+    BBox(const v3f& min_, const v3f& max_) : min(min_), max(max_) { }
+    BBox(const v3f& p) : min(p), max(p) { }
+
+    //! Box containing nothing, expanding it by a point or a box gives that point or box.
+    static BBox empty() {
+        const float inf = std::numeric_limits<float>::infinity();
+        return BBox(v3f(inf), v3f(-inf));
+    }
 
-    bool intersect(const TinyRender::Ray& r, float *tnear, float *tfar) const{
+    //! Slab test restricted to the interval [r.min_t, tend]. On a hit, writes the distances at
+    //! which the ray enters and leaves the box within that interval.
+    bool intersect(const TinyRender::Ray& r, float tend, float *tnear, float *tfar) const{
 
         float tmin = (min.x - r.o.x) / r.d.x;
         float tmax = (max.x - r.o.x) / r.d.x;
@@ -65,27 +51,42 @@ struct BBox {
         if (tzmax < tmax)
             tmax = tzmax;
 
+        // Clip to the ray interval
+        if (r.min_t > tmin)
+            tmin = r.min_t;
+
+        if (tend < tmax)
+            tmax = tend;
+
+        if (tmin > tmax)
+            return false;
+
+        *tnear = tmin;
+        *tfar = tmax;
         return true;
     }
 
     void expandToInclude(const v3f& p){
         min = glm::min(min, p);
         max = glm::max(max, p);
-        extent = max - min;
     }
 
     void expandToInclude(const BBox& b){
         min = glm::min(min, b.min);
         max = glm::max(max, b.max);
-        extent = max - min;
+    }
+    bool isEmpty() const{
+        return min.x > max.x || min.y > max.y || min.z > max.z;
     }
     uint32_t maxDimension() const{
+        const v3f extent = max - min;
         uint32_t result = 0;
         if(extent.y > extent.x) result = 1;
         if(extent.z > extent.y) result = 2;
         return result;
     }
     float surfaceArea() const{
+        const v3f extent = max - min;
         return 2.f*( extent.x*extent.z + extent.x*extent.y + extent.y*extent.z );
     }
 };
@@ -113,162 +114,54 @@ struct BVHBuildEntry {
 
 //! \author Brandon Pelfrey
 //! A Bounding Volume Hierarchy system for fast Ray-Object intersection tests
+//! (trees are built by TinyRender::BVHBuilder, see core/bvhbuild.h)
 class BVH {
-    uint32_t nNodes, nLeafs, leafSize;
-    std::vector<Object*>* build_prims;
+    uint32_t nNodes, nLeafs, maxDepth;
+    uint32_t stackSize;     // Traversal stack entries needed by the tree
 
 public:
-    BVH(std::vector<Object*>* objects, uint32_t leafSize = 4) : nNodes(0), nLeafs(0), leafSize(leafSize), build_prims(objects), flatTree(NULL) {
-//        Stopwatch sw;
-
-        // Build the tree based on the input object data set.
-        build();
-
-        // Output tree build time and statistics
-//        double constructionTime = sw.read();
-//        LOG_STAT("Built BVH (%d nodes, with %d leafs) in %d ms", nNodes, nLeafs, (int)(1000*constructionTime));
-    }
-
-    struct BVHBuildEntry {
-        // If non-zero then this is the index of the parent. (used in offsets)
-        uint32_t parent;
-        // The range of objects in the object list covered by this node.
-        uint32_t start, end;
-    };
-
-/*! Build the BVH, given an input data set
- *  - Handling our own stack is quite a bit faster than the recursive style.
- *  - Each build stack entry's parent field eventually stores the offset
- *    to the parent of that node. Before that is finally computed, it will
- *    equal exactly three other values. (These are the magic values Untouched,
- *    Untouched-1, and TouchedTwice).
- *  - The partition here was also slightly faster than std::partition.
- */
-    void build()
-    {
-        BVHBuildEntry todo[128];
-        uint32_t stackptr = 0;
-        const uint32_t Untouched    = 0xffffffff;
-        const uint32_t TouchedTwice = 0xfffffffd;
-
-        // Push the root
-        todo[stackptr].start = 0;
-        todo[stackptr].end = build_prims->size();
-        todo[stackptr].parent = 0xfffffffc;
-        stackptr++;
-
-        BVHFlatNode node;
-        std::vector<BVHFlatNode> buildnodes;
-        buildnodes.reserve(build_prims->size()*2);
-
-        while(stackptr > 0) {
-            // Pop the next item off of the stack
-            BVHBuildEntry &bnode( todo[--stackptr] );
-            uint32_t start = bnode.start;
-            uint32_t end = bnode.end;
-            uint32_t nPrims = end - start;
-
-            nNodes++;
-            node.start = start;
-            node.nPrims = nPrims;
-            node.rightOffset = Untouched;
-
-            // Calculate the bounding box for this node
-            BBox bb( (*build_prims)[start]->getBBox());
-            BBox bc( (*build_prims)[start]->getCentroid());
-            for(uint32_t p = start+1; p < end; ++p) {
-                bb.expandToInclude( (*build_prims)[p]->getBBox());
-                bc.expandToInclude( (*build_prims)[p]->getCentroid());
-            }
-            node.bbox = bb;
-
-            // If the number of primitives at this point is less than the leaf
-            // size, then this will become a leaf. (Signified by rightOffset == 0)
-            if(nPrims <= leafSize) {
-                node.rightOffset = 0;
-                nLeafs++;
-            }
+    //! Adopts a flattened tree (built, or mapped from a cache file), with its leaf count and depth.
+    BVH(TinyRender::AlignedArray<BVHFlatNode> tree, uint32_t leafCount, uint32_t treeDepth)
+        : nNodes(uint32_t(tree.size())), nLeafs(leafCount), maxDepth(treeDepth), stackSize(treeDepth + 2),
+          flatTree(std::move(tree)) { }
 
-            buildnodes.push_back(node);
+    //! Primitives in leaf order: a leaf covers indices[start, start + nPrims). With spatial splits,
+    //! a primitive may appear in several leaves.
+    std::vector<uint32_t> indices;
 
-            // Child touches parent...
-            // Special case: Don't do this for the root.
-            if(bnode.parent != 0xfffffffc) {
-                buildnodes[bnode.parent].rightOffset --;
-
-                // When this is the second touch, this is the right child.
-                // The right child sets up the offset for the flat tree.
-                if( buildnodes[bnode.parent].rightOffset == TouchedTwice ) {
-                    buildnodes[bnode.parent].rightOffset = nNodes - 1 - bnode.parent;
-                }
-            }
-
-            // If this is a leaf, no need to subdivide.
-            if(node.rightOffset == 0)
-                continue;
-
-            // Set the split dimensions
-            uint32_t split_dim = bc.maxDimension();
-
-            // Split on the center of the longest axis
-            float split_coord = .5f * (bc.min[split_dim] + bc.max[split_dim]);
-
-            // Partition the list of objects on this split
-            uint32_t mid = start;
-            for(uint32_t i=start;i<end;++i) {
-                if( (*build_prims)[i]->getCentroid()[split_dim] < split_coord ) {
-                    std::swap( (*build_prims)[i], (*build_prims)[mid] );
-                    ++mid;
-                }
-            }
-
-            // If we get a bad split, just choose the center...
-            if(mid == start || mid == end) {
-                mid = start + (end-start)/2;
-            }
-
-            // Push right child
-            todo[stackptr].start = mid;
-            todo[stackptr].end = end;
-            todo[stackptr].parent = nNodes-1;
-            stackptr++;
-
-            // Push left child
-            todo[stackptr].start = start;
-            todo[stackptr].end = mid;
-            todo[stackptr].parent = nNodes-1;
-            stackptr++;
-        }
-
-        // Copy the temp node data to a flat array
-        flatTree = new BVHFlatNode[nNodes];
-        for(uint32_t n=0; n<nNodes; ++n)
-            flatTree[n] = buildnodes[n];
-    }
+    uint32_t nodeCount() const { return nNodes; }
+    uint32_t leafCount() const { return nLeafs; }
+    uint32_t depth() const { return maxDepth; }
 
     // Fast Traversal System
-    BVHFlatNode *flatTree;
-
-public:
+    TinyRender::AlignedArray<BVHFlatNode> flatTree;
 
-//! - Compute the nearest intersection of all objects within the tree.
+//! - Compute the nearest intersection of all primitives within the tree.
+//! - intersect(i, t) tests the primitive at position i in leaf order, and returns true and
+//!   updates t if it is hit closer than t.
+//! - Only nodes overlapping [ray.min_t, t] are visited: t starts at the end of the ray interval
+//!   and shrinks as closer hits are found.
 //! - Return true if hit was found, false otherwise.
 //! - In the case where we want to find out of there is _ANY_ intersection at all,
 //!   set occlusion == true, in which case we exit on the first hit, rather
 //!   than find the closest.
-    bool getIntersection(const TinyRender::Ray& ray, IntersectionInfo* intersection, bool occlusion) const {
-        intersection->t = 999999999.f;
-        intersection->object = nullptr;
+    template<class Intersect>
+    bool getIntersection(const TinyRender::Ray& ray, float& t, const Intersect& intersect, bool occlusion) const {
+        if(flatTree.empty())
+            return false;
+        bool found = false;
         float bbhits[4] = {};
         int32_t closer, other;
 
-        // Working set
-        BVHTraversal todo[64];
+        // Working set, deep trees need more than the default stack
+        TinyRender::TraversalStack<BVHTraversal, 64> todo(stackSize);
         int32_t stackptr = 0;
 
         // "Push" on the root node to the working set
+        if(!flatTree[0].bbox.intersect(ray, t, bbhits, &bbhits[1]))
+            return false;
         todo[stackptr].i = 0;
-        todo[stackptr].mint = -9999999.f;
+        todo[stackptr].mint = bbhits[0];
 
         while(stackptr>=0) {
             // Pop off the next node to work on.
@@ -278,34 +171,25 @@ public:
             const BVHFlatNode &node(flatTree[ ni ]);
 
             // If this node is further than the closest found intersection, continue
-            if(near > intersection->t)
+            if(near > t)
                 continue;
+            TinyRender::BVHStats::countNode(occlusion);
 
             // Is leaf -> Intersect
             if( node.rightOffset == 0 ) {
                 for(uint32_t o=0;o<node.nPrims;++o) {
-                    IntersectionInfo current;
-
-                    const Object* obj = (*build_prims)[node.start+o];
-                    bool hit = obj->getIntersection(ray, &current);
-
-                    if (hit) {
+                    if (intersect(node.start+o, t)) {
                         // If we're only looking for occlusion, then any hit is good enough
                         if(occlusion) {
                             return true;
                         }
-
-                        // Otherwise, keep the closest intersection only
-                        if (current.t < intersection->t) {
-                            *intersection = current;
-                        }
+                        found = true;
                     }
                 }
 
             } else { // Not a leaf
-
-                bool hitc0 = flatTree[ni+1].bbox.intersect(ray, bbhits, &bbhits[1]);
-                bool hitc1 = flatTree[ni+node.rightOffset].bbox.intersect(ray, &bbhits[2], &bbhits[3]);
+                bool hitc0 = flatTree[ni+1].bbox.intersect(ray, t, bbhits, &bbhits[1]);
+                bool hitc1 = flatTree[ni+node.rightOffset].bbox.intersect(ray, t, &bbhits[2], &bbhits[3]);
 
                 // Did we hit both nodes?
                 if(hitc0 && hitc1) {
@@ -342,10 +226,6 @@ public:
             }
         }
 
-        return intersection->object != nullptr;
-    }
-
-    ~BVH() {
-        delete[] flatTree;
+        return found;
     }
 };
@@ -0,0 +1,330 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#include <core/accel.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * File mapped in memory. Pages are private and copy-on-write, so arrays viewing them may be modified
+ * without touching the file.
+ */
+struct MappedFile {
+    char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    static std::shared_ptr<MappedFile> open(const std::string& path) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+        HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) return nullptr;
+        LARGE_INTEGER size;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+            mapping = CreateFileMappingA(handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (mapping) {
+            file->data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+            file->size = size_t(size.QuadPart);
+            CloseHandle(mapping);
+        }
+        CloseHandle(handle);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                file->data = static_cast<char*>(p);
+                file->size = size_t(st.st_size);
+            }
+        }
+        close(fd);
+#endif
+        return file->data ? file : nullptr;
+    }
+
+    ~MappedFile() {
+        if (!data) return;
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap(data, size);
+#endif
+    }
+};
+
+/**
+ * BVH cache file: header, then the binary tree nodes, the triangles and the wide tree nodes, each starting
+ * on a 64-byte boundary so that they can be used in place. Arrays are stored in native byte order.
+ */
+static const char bvhCacheMagic[8] = {'T', 'R', 'B', 'V', 'H', '\0', '\0', '\0'};
+static const uint32_t bvhCacheVersion = 1;
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t depth;             // Binary tree depth
+    uint64_t key;               // Geometry fingerprint, settings and layout
+    uint64_t nodes, leaves;     // Binary tree
+    uint64_t triangles;
+    uint64_t wideNodes;         // Selected wide tree, if any
+    uint32_t wideDepth;
+    uint32_t padding;
+};
+
+static size_t alignCache(size_t offset) { return (offset + 63) & ~size_t(63); }
+
+/**
+ * Fingerprint of the settings the cached data was built with and of its memory layout.
+ */
+static uint64_t getSettingsKey(const BVHBuildSettings& s) {
+    Hasher h;
+    h.add(bvhCacheVersion);
+    h.add(s.sah);
+    h.add(s.leafSize);
+    h.add(s.bins);
+    h.add(s.intersectionCost);
+    h.add(s.width);
+    h.add(s.quantized);
+    h.add(s.spatialSplitBudget);
+    h.add(s.morton);
+    h.add(s.layout);
+    h.add(uint32_t(sizeof(BVHFlatNode)));
+    h.add(uint32_t(sizeof(AcceleratorBVH::Triangle)));
+    h.add(uint32_t(sizeof(WideBVHNode<4>)));
+    h.add(uint32_t(sizeof(QuantizedBVHNode<4>)));
+    return h.value;
+}
+
+/**
+ * Fingerprint of the cached data: the geometry and the settings.
+ */
+static uint64_t getCacheKey(uint64_t geometryHash, const BVHBuildSettings& s) {
+    Hasher h;
+    h.add(geometryHash);
+    h.add(getSettingsKey(s));
+    return h.value;
+}
+
+std::string AcceleratorBVH::getCachePath(const std::string& objPath) const {
+    return fs::path(objPath).replace_extension(tfm::format("%016x.bvh", getSettingsKey(settings))).string();
+}
+
+template<int N, class Node>
+static void describeWide(const std::unique_ptr<WideBVH<N, Node>>& tree, const char*& data, size_t& bytes,
+                         BVHCacheHeader& header) {
+    if (!tree) return;
+    data = reinterpret_cast<const char*>(tree->nodes.data());
+    bytes = tree->nodes.size() * sizeof(Node);
+    header.wideNodes = tree->nodes.size();
+    header.wideDepth = tree->maxDepth;
+}
+
+template<int N, class Node>
+static void mapWide(std::unique_ptr<WideBVH<N, Node>>& tree, bool selected, const BVHCacheHeader& header,
+                    size_t offset, const std::shared_ptr<MappedFile>& file, size_t& end) {
+    tree.reset();
+    if (!selected) return;
+    end = offset + header.wideNodes * sizeof(Node);
+    if (end > file->size) return;
+    Node* nodes = reinterpret_cast<Node*>(file->data + offset);
+    tree.reset(new WideBVH<N, Node>(AlignedArray<Node>::view(nodes, header.wideNodes, file), header.wideDepth));
+}
+
+bool AcceleratorBVH::save(const std::string& path, uint64_t geometryHash) const {
+    if (!bvh) return false;
+    BVHCacheHeader header = {};
+    std::copy(bvhCacheMagic, bvhCacheMagic + 8, header.magic);
+    header.version = bvhCacheVersion;
+    header.depth = bvh->depth();
+    header.key = getCacheKey(geometryHash, settings);
+    header.nodes = bvh->flatTree.size();
+    header.leaves = bvh->leafCount();
+    header.triangles = triangles.size();
+    const char* wide = nullptr;
+    size_t wideBytes = 0;
+    describeWide(bvh4, wide, wideBytes, header);
+    describeWide(bvh8, wide, wideBytes, header);
+    describeWide(qbvh4, wide, wideBytes, header);
+    describeWide(qbvh8, wide, wideBytes, header);
+
+    // Written under a unique name then renamed, so that concurrent processes never read a partial file
+    const std::string tmp = tfm::format("%s.%08x.tmp", path, std::random_device()());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) return false;
+        size_t offset = 0;
+        auto write = [&out, &offset](const void* data, size_t size) {
+            if (size == 0) return;
+            const char zeros[64] = {};
+            out.write(zeros, std::streamsize(alignCache(offset) - offset));
+            out.write((const char*) data, std::streamsize(size));
+            offset = alignCache(offset) + size;
+        };
+        write(&header, sizeof(header));
+        write(bvh->flatTree.data(), sizeof(BVHFlatNode) * bvh->flatTree.size());
+        write(triangles.data(), sizeof(Triangle) * triangles.size());
+        write(wide, wideBytes);
+        if (!out) {
+            out.close();
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    fs_error_code error;
+    fs::rename(tmp, path, error);
+    if (error) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool AcceleratorBVH::load(const std::string& path, uint64_t geometryHash) {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file || file->size < sizeof(BVHCacheHeader)) return false;
+    BVHCacheHeader header;
+    std::memcpy(&header, file->data, sizeof(header));
+    if (!std::equal(bvhCacheMagic, bvhCacheMagic + 8, header.magic) || header.version != bvhCacheVersion ||
+        header.key != getCacheKey(geometryHash, settings) || header.nodes == 0)
+        return false;
+
+    const size_t nodesOffset = alignCache(sizeof(header));
+    const size_t trianglesOffset = alignCache(nodesOffset + header.nodes * sizeof(BVHFlatNode));
+    const size_t wideOffset = alignCache(trianglesOffset + header.triangles * sizeof(Triangle));
+    size_t end = trianglesOffset + header.triangles * sizeof(Triangle);
+    const bool q = settings.quantized;
+    mapWide(bvh4, settings.width == 4 && !q, header, wideOffset, file, end);
+    mapWide(bvh8, settings.width == 8 && !q, header, wideOffset, file, end);
+    mapWide(qbvh4, settings.width == 4 && q, header, wideOffset, file, end);
+    mapWide(qbvh8, settings.width == 8 && q, header, wideOffset, file, end);
+    if (end != file->size || (settings.width != 2 && !bvh4 && !bvh8 && !qbvh4 && !qbvh8)) {
+        bvh4.reset();
+        bvh8.reset();
+        qbvh4.reset();
+        qbvh8.reset();
+        return false;
+    }
+
+    BVHFlatNode* nodes = reinterpret_cast<BVHFlatNode*>(file->data + nodesOffset);
+    bvh.reset(new BVH(AlignedArray<BVHFlatNode>::view(nodes, header.nodes, file), uint32_t(header.leaves),
+                      header.depth));
+    triangles = AlignedArray<Triangle>::view(reinterpret_cast<Triangle*>(file->data + trianglesOffset),
+                                             header.triangles, file);
+    return true;
+}
+
+/**
+ * Leaf size histogram: entry i counts the leaves of i primitives.
+ */
+static void countLeaf(std::vector<uint64_t>& sizes, uint32_t nPrims) {
+    if (nPrims >= sizes.size()) sizes.resize(nPrims + 1, 0);
+    sizes[nPrims]++;
+}
+
+static void writeLeafSizes(std::ostream& out, const std::vector<uint64_t>& sizes) {
+    out << "[";
+    for (size_t i = 0; i < sizes.size(); i++) out << (i ? ", " : "") << sizes[i];
+    out << "]";
+}
+
+static void writeBinaryStats(std::ostream& out, const BVH& tree, float intersectionCost, const std::string& indent) {
+    std::vector<uint64_t> sizes;
+    for (const BVHFlatNode& node : tree.flatTree)
+        if (node.rightOffset == 0) countLeaf(sizes, node.nPrims);
+    const float cost = BVHBuilder::sahCost(tree, intersectionCost);
+    out << "{\n";
+    out << indent << "  \"nodes\": " << tree.nodeCount() << ",\n";
+    out << indent << "  \"leaves\": " << tree.leafCount() << ",\n";
+    out << indent << "  \"maxDepth\": " << tree.depth() << ",\n";
+    out << indent << "  \"sahCost\": ";
+    if (std::isfinite(cost)) out << cost;
+    else out << "null";     // Flat root bounds
+    out << ",\n" << indent << "  \"leafSizes\": ";
+    writeLeafSizes(out, sizes);
+    out << "\n" << indent << "}";
+}
+
+template<int N, class Node>
+static void writeWideStats(std::ostream& out, const std::unique_ptr<WideBVH<N, Node>>& tree, bool quantized,
+                           const std::string& indent) {
+    if (!tree) return;
+    std::vector<uint64_t> sizes;
+    uint64_t leaves = 0;
+    for (const Node& node : tree->nodes) {
+        for (int i = 0; i < N; i++) {
+            if (node.count[i] == 0) continue;
+            countLeaf(sizes, node.count[i]);
+            leaves++;
+        }
+    }
+    out << ",\n" << indent << "  \"wide\": {\n";
+    out << indent << "    \"width\": " << N << ",\n";
+    out << indent << "    \"quantized\": " << (quantized ? "true" : "false") << ",\n";
+    out << indent << "    \"nodes\": " << tree->nodeCount() << ",\n";
+    out << indent << "    \"leaves\": " << leaves << ",\n";
+    out << indent << "    \"maxDepth\": " << tree->maxDepth << ",\n";
+    out << indent << "    \"leafSizes\": ";
+    writeLeafSizes(out, sizes);
+    out << "\n" << indent << "  }";
+}
+
+void AcceleratorBVH::writeStats(std::ostream& out, const std::string& indent) const {
+    out << "{\n";
+    if (top) {
+        out << indent << "  \"instances\": " << instances.size() << ",\n";
+        out << indent << "  \"top\": ";
+        writeBinaryStats(out, *top, settings.intersectionCost, indent + "  ");
+        out << ",\n" << indent << "  \"shapes\": [";
+        bool first = true;
+        for (const std::unique_ptr<AcceleratorBVH>& mesh : meshes) {
+            if (!mesh) continue;
+            out << (first ? "\n" : ",\n") << indent << "    ";
+            mesh->writeStats(out, indent + "    ");
+            first = false;
+        }
+        out << "\n" << indent << "  ]";
+    } else {
+        if (!shapeIDs.empty()) {
+            out << indent << "  \"shapeIDs\": [";
+            for (size_t j = 0; j < shapeIDs.size(); j++) out << (j ? ", " : "") << shapeIDs[j];
+            out << "],\n";
+        }
+        out << indent << "  \"triangles\": " << triangles.size() << ",\n";
+        out << indent << "  \"binary\": ";
+        if (bvh) writeBinaryStats(out, *bvh, settings.intersectionCost, indent + "  ");
+        else out << "null";
+        writeWideStats(out, bvh4, false, indent);
+        writeWideStats(out, bvh8, false, indent);
+        writeWideStats(out, qbvh4, true, indent);
+        writeWideStats(out, qbvh8, true, indent);
+    }
+    out << ",\n" << indent << "  \"memoryBytes\": " << memoryUsage();
+    out << "\n" << indent << "}";
+}
+
+TR_NAMESPACE_END
@@ -8,165 +8,529 @@
 #pragma once
 
 #include "core.h"
+#include "parallel.h"
+#include "bvhstats.h"
 #include "bvh.h"
+#include "bvhbuild.h"
+#include "widebvh.h"
 
 TR_NAMESPACE_BEGIN
 
 /**
  * Bounding-volume hierarchy (BVH) acceleration structure.
+ * Either one tree over all the triangles of the scene, or a two-level structure when shapes are
+ * instanced: a tree per shape (bottom level), traversed in object space, under a tree over the
+ * world bounds of the instances (top level).
  */
 struct AcceleratorBVH {
 
-    struct BVHNode : Object {
-
-        const size_t shapeID, faceID;
-        const WorldData& worldData;
-
-        BVHNode(size_t j, size_t i, const WorldData& d) : shapeID(j), faceID(i), worldData(d) { }
-
-        bool getIntersection(const Ray& ray, IntersectionInfo* intersection) const override {
-            const tinyobj::attrib_t& a = worldData.attrib;
-            const tinyobj::mesh_t& m = worldData.shapes[shapeID].mesh;
-            const tinyobj::index_t& idx0 = m.indices[faceID + 0];
-            const tinyobj::index_t& idx1 = m.indices[faceID + 1];
-            const tinyobj::index_t& idx2 = m.indices[faceID + 2];
-
-            const v3f v0 = {a.vertices[3 * idx0.vertex_index + 0], a.vertices[3 * idx0.vertex_index + 1],
-                            a.vertices[3 * idx0.vertex_index + 2]};
-            const v3f v1 = {a.vertices[3 * idx1.vertex_index + 0], a.vertices[3 * idx1.vertex_index + 1],
-                            a.vertices[3 * idx1.vertex_index + 2]};
-            const v3f v2 = {a.vertices[3 * idx2.vertex_index + 0], a.vertices[3 * idx2.vertex_index + 1],
-                            a.vertices[3 * idx2.vertex_index + 2]};
-
-            float t, u, v;
-            if (rayTriangleIntersect(ray, v0, v1, v2, t, u, v)) {
-                if (t > 1e-3) {
-                    intersection->t = t;
-                    intersection->u = u;
-                    intersection->v = v;
-                    intersection->object = this;
-                    return true;
+    /**
+     * Triangle in the layout used by the intersection test: first vertex and the two edges from it.
+     * Shading data is fetched from the scene on hit only.
+     */
+    struct alignas(16) Triangle {
+        v3f v0, e1, e2;
+        uint32_t shapeID, primID;
+    };
+
+    /**
+     * Shape placed in the two-level structure.
+     */
+    struct Instance {
+        uint32_t shapeID;
+        mat4f toWorld, toLocal;
+    };
+
+    std::unique_ptr<BVH> bvh;
+    std::unique_ptr<WideBVH<4>> bvh4;     // Collapsed trees used for traversal when selected
+    std::unique_ptr<WideBVH<8>> bvh8;
+    std::unique_ptr<WideBVH<4, QuantizedBVHNode<4>>> qbvh4;
+    std::unique_ptr<WideBVH<8, QuantizedBVHNode<8>>> qbvh8;
+    AlignedArray<Triangle> triangles;   // In BVH leaf order
+    const WorldData& worldData;
+    BVHBuildSettings settings;
+    std::vector<uint32_t> shapeIDs;     // Shapes covered by the tree, all of them if empty
+
+    std::vector<Instance> instances;    // Two-level structure if not empty, shapes are not implicitly instanced
+    std::vector<std::unique_ptr<AcceleratorBVH>> meshes;   // Bottom level, per shape (null if not instanced)
+    std::unique_ptr<BVH> top;           // Top level, its indices map leaf positions to instances
+    float builtCost = 0.f;              // SAH cost of the tree when it was built (0: unknown)
+
+    explicit AcceleratorBVH(const WorldData& worldData, const BVHBuildSettings& settings = BVHBuildSettings(),
+                            std::vector<Instance> instances = std::vector<Instance>())
+        : worldData(worldData), settings(settings), instances(std::move(instances)) { }
+
+    /**
+     * Construction settings selected in the scene configuration, with its builder or another one.
+     */
+    static BVHBuildSettings getSettings(const Config& config) { return getSettings(config, config.accel); }
+
+    static BVHBuildSettings getSettings(const Config& config, EAccelBuilder builder) {
+        BVHBuildSettings settings;
+        settings.sah = builder == ESAHBuilder || builder == ESBVHBuilder;
+        settings.spatialSplitBudget = builder == ESBVHBuilder ? config.bvhSplitBudget : 0.f;
+        settings.morton = builder == ELBVHBuilder;
+        settings.layout = config.bvhLayout;
+        settings.leafSize = uint32_t(std::max(1, config.bvhLeafSize));
+        settings.bins = uint32_t(std::max(2, config.bvhBins));
+        settings.intersectionCost = config.bvhLeafCost;
+        settings.width = uint32_t(config.bvhWidth);
+        settings.quantized = config.bvhQuantized;
+        return settings;
+    }
+
+    /**
+     * Vertices of a triangle of the scene.
+     */
+    void getVertices(size_t shapeID, size_t primID, v3f& v0, v3f& v1, v3f& v2) const {
+        const tinyobj::attrib_t& a = worldData.attrib;
+        const tinyobj::mesh_t& m = worldData.shapes[shapeID].mesh;
+        const tinyobj::index_t& idx0 = m.indices[3 * primID + 0];
+        const tinyobj::index_t& idx1 = m.indices[3 * primID + 1];
+        const tinyobj::index_t& idx2 = m.indices[3 * primID + 2];
+
+        v0 = {a.vertices[3 * idx0.vertex_index + 0], a.vertices[3 * idx0.vertex_index + 1],
+              a.vertices[3 * idx0.vertex_index + 2]};
+        v1 = {a.vertices[3 * idx1.vertex_index + 0], a.vertices[3 * idx1.vertex_index + 1],
+              a.vertices[3 * idx1.vertex_index + 2]};
+        v2 = {a.vertices[3 * idx2.vertex_index + 0], a.vertices[3 * idx2.vertex_index + 1],
+              a.vertices[3 * idx2.vertex_index + 2]};
+    }
+
+    /**
+     * Builds the BVH over all triangles, or the two levels if there are instances, on the thread pool if given.
+     */
+    bool build(ThreadPool* pool = nullptr) {
+        if (!instances.empty()) {
+            meshes.clear();
+            meshes.resize(worldData.shapes.size());
+            for (const Instance& instance : instances) {
+                std::unique_ptr<AcceleratorBVH>& mesh = meshes[instance.shapeID];
+                if (mesh) continue;
+                mesh.reset(new AcceleratorBVH(worldData, settings));
+                mesh->shapeIDs.push_back(instance.shapeID);
+                mesh->build(pool);
+            }
+            buildTop();
+            return true;
+        }
+
+        // First triangle of every shape
+        std::vector<uint32_t> ids = shapeIDs;
+        if (ids.empty())
+            for (size_t j = 0; j < worldData.shapes.size(); j++) ids.push_back(uint32_t(j));
+        std::vector<size_t> offsets(ids.size() + 1, 0);
+        for (size_t j = 0; j < ids.size(); j++)
+            offsets[j + 1] = offsets[j] + worldData.shapes[ids[j]].mesh.indices.size() / 3;
+
+        // Calls f(i, shapeID, primID) over chunks of the triangles
+        const size_t n = offsets.back();
+        const size_t nChunks = pool ? std::max(size_t(1), std::min(size_t(pool->size()) * 4, n / 4096)) : 1;
+        auto forTriangles = [pool, &ids, &offsets, n, nChunks](const std::function<void(size_t, size_t, size_t)>& f) {
+            auto chunk = [&](size_t c) {
+                const size_t begin = n * c / nChunks, end = n * (c + 1) / nChunks;
+                size_t j = size_t(std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin()) - 1;
+                for (size_t i = begin; i < end; i++) {
+                    while (i >= offsets[j + 1]) j++;
+                    f(i, ids[j], i - offsets[j]);
                 }
+            };
+            if (nChunks > 1) pool->parallelFor(nChunks, chunk);
+            else chunk(0);
+        };
+
+        // Spatial splits also need the vertices
+        const bool spatialSplits = settings.sah && settings.spatialSplitBudget > 0.f;
+        std::vector<BBox> boxes(n);
+        std::vector<v3f> centroids(n);
+        std::vector<v3f> vertices(spatialSplits ? 3 * n : 0);
+        forTriangles([&](size_t i, size_t shapeID, size_t primID) {
+            v3f v0, v1, v2;
+            getVertices(shapeID, primID, v0, v1, v2);
+            boxes[i] = BBox(v0);
+            boxes[i].expandToInclude(v1);
+            boxes[i].expandToInclude(v2);
+            centroids[i] = (v0 + v1 + v2) / 3.0f;
+            if (spatialSplits) {
+                vertices[3 * i + 0] = v0;
+                vertices[3 * i + 1] = v1;
+                vertices[3 * i + 2] = v2;
             }
-            return false;
+        });
+
+        bvh = BVHBuilder(std::move(boxes), std::move(centroids), settings, pool, std::move(vertices)).build();
+        builtCost = BVHBuilder::sahCost(*bvh, settings.intersectionCost);
+
+        // Store the triangles in leaf order, so that leaves read contiguous memory. With spatial splits,
+        // a triangle may be stored once per leaf referencing it.
+        std::vector<Triangle> unordered(n);
+        forTriangles([&](size_t i, size_t shapeID, size_t primID) {
+            v3f v0, v1, v2;
+            getVertices(shapeID, primID, v0, v1, v2);
+            Triangle& tri = unordered[i];
+            tri.v0 = v0;
+            tri.e1 = v1 - v0;
+            tri.e2 = v2 - v0;
+            tri.shapeID = uint32_t(shapeID);
+            tri.primID = uint32_t(primID);
+        });
+        triangles.resize(bvh->indices.size());
+        for (size_t k = 0; k < bvh->indices.size(); k++)
+            triangles[k] = unordered[bvh->indices[k]];
+        bvh->indices = std::vector<uint32_t>();
+        collapse();
+        return true;
+    }
+
+    /**
+     * Updates the tree after vertices moved, with the same triangles: triangles are recomputed from the
+     * scene and the node bounds refit bottom-up, in parallel on the thread pool if given, then the wide
+     * tree is collapsed again. The tree is rebuilt instead once its SAH cost exceeds rebuildThreshold
+     * times its cost when built (0: never). Returns true if (some of) the tree was rebuilt.
+     * Triangles split between leaves (spatial splits) are refit with their whole bounds.
+     */
+    bool refit(ThreadPool* pool = nullptr, float rebuildThreshold = 0.f) {
+        if (!instances.empty()) {
+            bool rebuilt = false;
+            for (std::unique_ptr<AcceleratorBVH>& mesh : meshes)
+                if (mesh) rebuilt |= mesh->refit(pool, rebuildThreshold);
+            buildTop();
+            return rebuilt;
         }
+        if (!bvh || triangles.empty()) return false;
+        if (rebuildThreshold > 0.f && builtCost <= 0.f)
+            builtCost = BVHBuilder::sahCost(*bvh, settings.intersectionCost);
+
+        // Triangles and their bounds, in leaf order
+        const size_t n = triangles.size();
+        std::vector<BBox> boxes(n);
+        auto chunk = [this, &boxes, n](size_t c, size_t nChunks) {
+            for (size_t i = n * c / nChunks; i < n * (c + 1) / nChunks; i++) {
+                Triangle& tri = triangles[i];
+                v3f v0, v1, v2;
+                getVertices(tri.shapeID, tri.primID, v0, v1, v2);
+                tri.v0 = v0;
+                tri.e1 = v1 - v0;
+                tri.e2 = v2 - v0;
+                boxes[i] = BBox(v0);
+                boxes[i].expandToInclude(v1);
+                boxes[i].expandToInclude(v2);
+            }
+        };
+        const size_t nChunks = pool ? std::max(size_t(1), std::min(size_t(pool->size()) * 4, n / 4096)) : 1;
+        if (nChunks > 1) pool->parallelFor(nChunks, [&chunk, nChunks](size_t c) { chunk(c, nChunks); });
+        else chunk(0, 1);
+        BVHBuilder::refit(*bvh, boxes, pool);
 
-        v3f getNormal(const IntersectionInfo&) const override {
-            const tinyobj::mesh_t& m = worldData.shapes[shapeID].mesh;
-            const tinyobj::index_t& idx0 = m.indices[faceID + 0];
-            const tinyobj::index_t& idx1 = m.indices[faceID + 1];
-            const tinyobj::index_t& idx2 = m.indices[faceID + 2];
-
-            const tinyobj::attrib_t& a = worldData.attrib;
-            const v3f v0 = {a.normals[3 * idx0.normal_index + 0], a.normals[3 * idx0.normal_index + 1],
-                            a.normals[3 * idx0.normal_index + 2]};
-            const v3f v1 = {a.normals[3 * idx1.normal_index + 0], a.normals[3 * idx1.normal_index + 1],
-                            a.normals[3 * idx1.normal_index + 2]};
-            const v3f v2 = {a.normals[3 * idx2.normal_index + 0], a.normals[3 * idx2.normal_index + 1],
-                            a.normals[3 * idx2.normal_index + 2]};
-
-            return glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        const float cost = BVHBuilder::sahCost(*bvh, settings.intersectionCost);
+        if (rebuildThreshold > 0.f && cost > rebuildThreshold * builtCost) {
+            build(pool);
+            return true;
         }
+        collapse();
+        return false;
+    }
 
-        BBox getBBox() const override {
-            const tinyobj::mesh_t& m = worldData.shapes[shapeID].mesh;
-            const tinyobj::index_t& idx0 = m.indices[faceID + 0];
-            const tinyobj::index_t& idx1 = m.indices[faceID + 1];
-            const tinyobj::index_t& idx2 = m.indices[faceID + 2];
-
-            const tinyobj::attrib_t& a = worldData.attrib;
-            const v3f v0 = {a.vertices[3 * idx0.vertex_index + 0], a.vertices[3 * idx0.vertex_index + 1],
-                            a.vertices[3 * idx0.vertex_index + 2]};
-            const v3f v1 = {a.vertices[3 * idx1.vertex_index + 0], a.vertices[3 * idx1.vertex_index + 1],
-                            a.vertices[3 * idx1.vertex_index + 2]};
-            const v3f v2 = {a.vertices[3 * idx2.vertex_index + 0], a.vertices[3 * idx2.vertex_index + 1],
-                            a.vertices[3 * idx2.vertex_index + 2]};
-
-            BBox b(v0);
-            b.expandToInclude(v1);
-            b.expandToInclude(v2);
-            return b;
+    /**
+     * (Re)builds the top level over the world bounds of the instances, e.g. after some of them moved.
+     * Instances of shapes without triangles are skipped.
+     */
+    void buildTop() {
+        std::vector<BBox> boxes;
+        std::vector<v3f> centroids;
+        std::vector<uint32_t> ids;
+        for (size_t k = 0; k < instances.size(); k++) {
+            const Instance& instance = instances[k];
+            const AcceleratorBVH& mesh = *meshes[instance.shapeID];
+            if (mesh.triangles.empty()) continue;
+            const BBox& local = mesh.bvh->flatTree[0].bbox;
+            BBox world(v3f(instance.toWorld * v4f(local.min, 1.f)));
+            for (int c = 1; c < 8; c++) {
+                const v3f corner(c & 1 ? local.max.x : local.min.x, c & 2 ? local.max.y : local.min.y,
+                                 c & 4 ? local.max.z : local.min.z);
+                world.expandToInclude(v3f(instance.toWorld * v4f(corner, 1.f)));
+            }
+            boxes.push_back(world);
+            centroids.push_back(0.5f * (world.min + world.max));
+            ids.push_back(uint32_t(k));
         }
+        BVHBuildSettings topSettings = settings;
+        topSettings.leafSize = 1;
+        top = BVHBuilder(std::move(boxes), std::move(centroids), topSettings).build();
+        for (uint32_t& i : top->indices) i = ids[i];
+    }
 
-        v3f getCentroid() const override {
-            const tinyobj::mesh_t& m = worldData.shapes[shapeID].mesh;
-            const tinyobj::index_t& idx0 = m.indices[faceID + 0];
-            const tinyobj::index_t& idx1 = m.indices[faceID + 1];
-            const tinyobj::index_t& idx2 = m.indices[faceID + 2];
-
-            const tinyobj::attrib_t& a = worldData.attrib;
-            const v3f v0 = {a.vertices[3 * idx0.vertex_index + 0], a.vertices[3 * idx0.vertex_index + 1],
-                            a.vertices[3 * idx0.vertex_index + 2]};
-            const v3f v1 = {a.vertices[3 * idx1.vertex_index + 0], a.vertices[3 * idx1.vertex_index + 1],
-                            a.vertices[3 * idx1.vertex_index + 2]};
-            const v3f v2 = {a.vertices[3 * idx2.vertex_index + 0], a.vertices[3 * idx2.vertex_index + 1],
-                            a.vertices[3 * idx2.vertex_index + 2]};
-
-            return (v0 + v1 + v2) / 3.0f;
+    /**
+     * Moves an instance, only the top level is rebuilt.
+     */
+    void setTransform(size_t instanceID, const mat4f& toWorld) {
+        instances[instanceID].toWorld = toWorld;
+        instances[instanceID].toLocal = glm::inverse(toWorld);
+        buildTop();
+    }
+
+    /**
+     * (Re)creates the wide tree selected by settings.width and settings.quantized from the binary tree,
+     * with the nodes in the order of settings.layout.
+     */
+    void collapse() {
+        for (std::unique_ptr<AcceleratorBVH>& mesh : meshes) {
+            if (!mesh) continue;
+            mesh->settings = settings;
+            mesh->collapse();
         }
-    };
+        if (!bvh) return;
+        if (settings.layout == EAreaLayout) BVHBuilder::orderByArea(*bvh);
+        const bool q = settings.quantized;
+        bvh4.reset(settings.width == 4 && !q ? new WideBVH<4>(*bvh) : nullptr);
+        bvh8.reset(settings.width == 8 && !q ? new WideBVH<8>(*bvh) : nullptr);
+        qbvh4.reset(settings.width == 4 && q ? new WideBVH<4, QuantizedBVHNode<4>>(*bvh) : nullptr);
+        qbvh8.reset(settings.width == 8 && q ? new WideBVH<8, QuantizedBVHNode<8>>(*bvh) : nullptr);
+        if (bvh4) bvh4->relayout(settings.layout);
+        if (bvh8) bvh8->relayout(settings.layout);
+        if (qbvh4) qbvh4->relayout(settings.layout);
+        if (qbvh8) qbvh8->relayout(settings.layout);
+    }
 
-    std::unique_ptr<BVH> bvh;
-    std::vector<Object*> objects;
-    const WorldData& worldData;
+    /**
+     * Traverses the selected tree, see BVH::getIntersection.
+     */
+    template<class Intersect>
+    bool getIntersection(const Ray& ray, float& t, const Intersect& intersect, bool occlusion) const {
+        if (bvh4) return bvh4->getIntersection(ray, t, intersect, occlusion);
+        if (bvh8) return bvh8->getIntersection(ray, t, intersect, occlusion);
+        if (qbvh4) return qbvh4->getIntersection(ray, t, intersect, occlusion);
+        if (qbvh8) return qbvh8->getIntersection(ray, t, intersect, occlusion);
+        return bvh->getIntersection(ray, t, intersect, occlusion);
+    }
 
-    explicit AcceleratorBVH(const WorldData& worldData) : worldData(worldData) { }
+    /**
+     * Cache file of the binary tree, the triangles and the selected wide tree, valid for the given
+     * geometry fingerprint and the current settings. Loading maps the file: arrays are used in place
+     * and only the pages touched by traversal are read.
+     */
+    bool save(const std::string& path, uint64_t geometryHash) const;
+    bool load(const std::string& path, uint64_t geometryHash);
 
-    bool build() {
-        for (size_t j = 0; j < worldData.shapes.size(); j++) {
-            const tinyobj::shape_t& shape = worldData.shapes[j];
-            for (size_t i = 0; i < shape.mesh.indices.size(); i += 3)
-                objects.emplace_back(new BVHNode(j, i, worldData));
-        }
-        bvh = std::unique_ptr<BVH>(new BVH(&objects));
+    /**
+     * Cache file next to an OBJ file, named after the current settings (<mesh>.<settings key>.bvh), so that
+     * scenes sharing a mesh with different settings keep their own cache.
+     */
+    std::string getCachePath(const std::string& objPath) const;
+
+    /**
+     * Quality of the built trees as a JSON object: node and leaf counts, depth, SAH cost and leaf sizes of the
+     * binary tree and of the selected wide tree, or of the top level and of every shape tree with instances.
+     */
+    void writeStats(std::ostream& out, const std::string& indent = "") const;
+
+    /**
+     * Memory used by the triangles and the tree, in bytes.
+     */
+    size_t memoryUsage() const {
+        size_t bytes = triangles.size() * sizeof(Triangle) + (bvh ? bvh->flatTree.size() * sizeof(BVHFlatNode) : 0);
+        for (const std::unique_ptr<AcceleratorBVH>& mesh : meshes)
+            if (mesh) bytes += mesh->memoryUsage();
+        if (top) bytes += top->flatTree.size() * sizeof(BVHFlatNode) + instances.size() * sizeof(Instance);
+        if (bvh4) bytes += bvh4->nodes.size() * sizeof(WideBVHNode<4>);
+        if (bvh8) bytes += bvh8->nodes.size() * sizeof(WideBVHNode<8>);
+        if (qbvh4) bytes += qbvh4->nodes.size() * sizeof(QuantizedBVHNode<4>);
+        if (qbvh8) bytes += qbvh8->nodes.size() * sizeof(QuantizedBVHNode<8>);
+        return bytes;
+    }
+
+    /**
+     * Ray-triangle test on precomputed edges (Moller-Trumbore, as rayTriangleIntersect).
+     * Returns true and updates t if the triangle is hit in (tmin, t).
+     */
+    static bool intersectTriangle(const Ray& r, const Triangle& tri, float tmin, float& t, float& u, float& v) {
+        const v3f pvec = glm::cross(r.d, tri.e2);
+        const float det = glm::dot(tri.e1, pvec);
+        if (std::fabs(det) < Epsilon) return false;
+        const float invDet = 1 / det;
+        const v3f tvec = r.o - tri.v0;
+        const float ui = glm::dot(tvec, pvec) * invDet;
+        if (ui < 0 || ui > 1) return false;
+        const v3f qvec = glm::cross(tvec, tri.e1);
+        const float vi = glm::dot(r.d, qvec) * invDet;
+        if (vi < 0 || ui + vi > 1) return false;
+        const float ti = glm::dot(tri.e2, qvec) * invDet;
+        if (ti <= tmin || ti >= t) return false;
+        t = ti;
+        u = ui;
+        v = vi;
         return true;
     }
 
+    /**
+     * Visibility query: returns whether any triangle is hit between ray.min_t and min(tmax, ray.max_t).
+     * Traversal stops at the first hit and no shading data is computed.
+     */
+    bool occluded(const Ray& ray, float tmax = std::numeric_limits<float>::max()) const {
+        float t = std::min(tmax, ray.max_t), u, v;
+        const float tmin = std::max(1e-3f, ray.min_t);
+        BVHStats::countRay(true);
+        if (top) {
+            uint32_t instanceID, hitID;
+            return intersectInstances(ray, tmin, t, true, instanceID, hitID, u, v);
+        }
+        const Triangle* tris = triangles.data();
+        return getIntersection(ray, t, [&ray, tris, tmin, &u, &v](uint32_t i, float& t) {
+            BVHStats::countTriangle(true);
+            return intersectTriangle(ray, tris[i], tmin, t, u, v);
+        }, true);
+    }
+
     bool intersect(const Ray& ray, SurfaceInteraction& info) const {
-        IntersectionInfo iInfo{};
-        iInfo.object = nullptr;
-        const std::vector<tinyobj::shape_t>& ss = worldData.shapes;
-        const tinyobj::attrib_t& sa = worldData.attrib;
+        // Traversal and triangle tests are restricted to the ray interval
+        float t = ray.max_t, u = 0.f, v = 0.f;
+        const float tmin = std::max(1e-3f, ray.min_t);
+        uint32_t hitID = 0;
+        BVHStats::countRay(false);
+        if (top) {
+            uint32_t instanceID = 0;
+            if (!intersectInstances(ray, tmin, t, false, instanceID, hitID, u, v)) {
+                info.t = std::numeric_limits<float>::max();
+                return false;
+            }
+            const Instance& instance = instances[instanceID];
+            meshes[instance.shapeID]->getInteraction(ray, hitID, t, u, v, info, &instance.toWorld);
+            return true;
+        }
+        const Triangle* tris = triangles.data();
+        auto intersectLeaf = [&ray, tris, tmin, &u, &v, &hitID](uint32_t i, float& t) {
+            BVHStats::countTriangle(false);
+            if (!intersectTriangle(ray, tris[i], tmin, t, u, v)) return false;
+            hitID = i;
+            return true;
+        };
+
+        if (!getIntersection(ray, t, intersectLeaf, false)) {
+            info.t = std::numeric_limits<float>::max();
+            return false;
+        }
+        getInteraction(ray, hitID, t, u, v, info);
+        return true;
+    }
 
-        if (bvh->getIntersection(ray, &iInfo, false)) {
-            info.t = iInfo.t;
-            if (iInfo.t <= ray.max_t && iInfo.t >= ray.min_t) {
-                const tinyobj::shape_t& s = ss[((BVHNode*) (iInfo.object))->shapeID];
-                const size_t i = ((BVHNode*) (iInfo.object))->faceID;
-                const tinyobj::index_t& idx0 = s.mesh.indices[i + 0];
-                const tinyobj::index_t& idx1 = s.mesh.indices[i + 1];
-                const tinyobj::index_t& idx2 = s.mesh.indices[i + 2];
-
-                const v3f v0 = {sa.vertices[3 * idx0.vertex_index + 0], sa.vertices[3 * idx0.vertex_index + 1],
-                                sa.vertices[3 * idx0.vertex_index + 2]};
-                const v3f v1 = {sa.vertices[3 * idx1.vertex_index + 0], sa.vertices[3 * idx1.vertex_index + 1],
-                                sa.vertices[3 * idx1.vertex_index + 2]};
-                const v3f v2 = {sa.vertices[3 * idx2.vertex_index + 0], sa.vertices[3 * idx2.vertex_index + 1],
-                                sa.vertices[3 * idx2.vertex_index + 2]};
-
-                const v3f n0 = {sa.normals[3 * idx0.normal_index + 0], sa.normals[3 * idx0.normal_index + 1],
-                                sa.normals[3 * idx0.normal_index + 2]};
-                const v3f n1 = {sa.normals[3 * idx1.normal_index + 0], sa.normals[3 * idx1.normal_index + 1],
-                                sa.normals[3 * idx1.normal_index + 2]};
-                const v3f n2 = {sa.normals[3 * idx2.normal_index + 0], sa.normals[3 * idx2.normal_index + 1],
-                                sa.normals[3 * idx2.normal_index + 2]};
-
-                info.shapeID = ((BVHNode*) (iInfo.object))->shapeID;
-                info.primID = ((BVHNode*) (iInfo.object))->faceID / 3;
-                info.t = iInfo.t;
-                info.u = iInfo.u;
-                info.v = iInfo.v;
-                info.p = barycentric(v0, v1, v2, iInfo.u, iInfo.v);
-                info.frameNg = Frame(glm::normalize(glm::cross(v1 - v0, v2 - v0)));
-                info.frameNs = Frame(glm::normalize(barycentric(n0, n1, n2, info.u, info.v)));
-                info.wo = info.frameNs.toLocal(-ray.d);
-                info.matID = s.mesh.material_ids[info.primID];
+    static const int PacketSize = WideBVH<4>::MaxPacketSize;
+
+    /**
+     * Closest-hit queries for up to PacketSize coherent rays, such as camera rays of neighboring pixels.
+     * Results are those of intersect() on every ray. The rays are traversed together through the wide tree
+     * when they all point to the same octant, and one by one otherwise (or with the binary tree).
+     */
+    void intersect(const Ray* rays, int count, SurfaceInteraction* hits, bool* found) const {
+        bool coherent = (bvh4 || bvh8 || qbvh4 || qbvh8) && count > 1 && count <= PacketSize;
+        for (int k = 1; k < count && coherent; k++)
+            for (int a = 0; a < 3; a++)
+                coherent &= std::signbit(rays[k].d[a]) == std::signbit(rays[0].d[a]);
+        if (!coherent) {
+            for (int k = 0; k < count; k++) found[k] = intersect(rays[k], hits[k]);
+            return;
+        }
+
+        float t[PacketSize], tmin[PacketSize], u[PacketSize], v[PacketSize];
+        uint32_t hitID[PacketSize];
+        for (int k = 0; k < count; k++) {
+            t[k] = rays[k].max_t;
+            tmin[k] = std::max(1e-3f, rays[k].min_t);
+            hitID[k] = std::numeric_limits<uint32_t>::max();
+            BVHStats::countRay(false);
+        }
+        const Triangle* tris = triangles.data();
+        auto intersectLeaf = [rays, tris, &tmin, &u, &v, &hitID](int k, uint32_t i, float& t) {
+            BVHStats::countTriangle(false);
+            if (!intersectTriangle(rays[k], tris[i], tmin[k], t, u[k], v[k])) return false;
+            hitID[k] = i;
+            return true;
+        };
+        if (bvh4) bvh4->getIntersections(rays, count, t, intersectLeaf);
+        else if (bvh8) bvh8->getIntersections(rays, count, t, intersectLeaf);
+        else if (qbvh4) qbvh4->getIntersections(rays, count, t, intersectLeaf);
+        else qbvh8->getIntersections(rays, count, t, intersectLeaf);
+
+        for (int k = 0; k < count; k++) {
+            found[k] = hitID[k] != std::numeric_limits<uint32_t>::max();
+            if (found[k]) getInteraction(rays[k], hitID[k], t[k], u[k], v[k], hits[k]);
+            else hits[k].t = std::numeric_limits<float>::max();
+        }
+    }
+
+    /**
+     * Two-level traversal: the ray is transformed to the object space of the instances it reaches, where
+     * their shape trees are traversed (t is the same in both spaces). On a hit, returns the instance and
+     * the position of the triangle in the leaf order of its shape.
+     */
+    bool intersectInstances(const Ray& ray, float tmin, float& t, bool occlusion, uint32_t& instanceID,
+                            uint32_t& hitID, float& u, float& v) const {
+        return top->getIntersection(ray, t, [&](uint32_t k, float& t) {
+            const uint32_t id = top->indices[k];
+            const Instance& instance = instances[id];
+            const Ray local(v3f(instance.toLocal * v4f(ray.o, 1.f)), v3f(instance.toLocal * v4f(ray.d, 0.f)),
+                            ray.min_t, ray.max_t);
+            const AcceleratorBVH& mesh = *meshes[instance.shapeID];
+            const Triangle* tris = mesh.triangles.data();
+            uint32_t i = 0;
+            const bool hit = mesh.getIntersection(local, t, [&local, tris, tmin, &u, &v, &i, occlusion](uint32_t j, float& t) {
+                BVHStats::countTriangle(occlusion);
+                if (!intersectTriangle(local, tris[j], tmin, t, u, v)) return false;
+                i = j;
                 return true;
+            }, occlusion);
+            if (hit) {
+                instanceID = id;
+                hitID = i;
             }
-            return false;
+            return hit;
+        }, occlusion);
+    }
+
+    /**
+     * Shading data of a hit on the triangle at position hitID in leaf order, placed in the world by toWorld
+     * if given.
+     */
+    void getInteraction(const Ray& ray, uint32_t hitID, float t, float u, float v, SurfaceInteraction& info,
+                        const mat4f* toWorld = nullptr) const {
+        const std::vector<tinyobj::shape_t>& ss = worldData.shapes;
+        const tinyobj::attrib_t& sa = worldData.attrib;
+        const Triangle& tri = triangles[hitID];
+        const tinyobj::shape_t& s = ss[tri.shapeID];
+        const size_t i = 3 * size_t(tri.primID);
+        const tinyobj::index_t& idx0 = s.mesh.indices[i + 0];
+        const tinyobj::index_t& idx1 = s.mesh.indices[i + 1];
+        const tinyobj::index_t& idx2 = s.mesh.indices[i + 2];
+
+        v3f v0, v1, v2;
+        getVertices(tri.shapeID, tri.primID, v0, v1, v2);
+
+        v3f n0 = {sa.normals[3 * idx0.normal_index + 0], sa.normals[3 * idx0.normal_index + 1],
+                  sa.normals[3 * idx0.normal_index + 2]};
+        v3f n1 = {sa.normals[3 * idx1.normal_index + 0], sa.normals[3 * idx1.normal_index + 1],
+                  sa.normals[3 * idx1.normal_index + 2]};
+        v3f n2 = {sa.normals[3 * idx2.normal_index + 0], sa.normals[3 * idx2.normal_index + 1],
+                  sa.normals[3 * idx2.normal_index + 2]};
+
+        if (toWorld) {
+            const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(*toWorld)));
+            v0 = v3f(*toWorld * v4f(v0, 1.f));
+            v1 = v3f(*toWorld * v4f(v1, 1.f));
+            v2 = v3f(*toWorld * v4f(v2, 1.f));
+            n0 = normalMatrix * n0;
+            n1 = normalMatrix * n1;
+            n2 = normalMatrix * n2;
         }
-        info.t = std::numeric_limits<float>::max();
-        return false;
+
+        info.shapeID = tri.shapeID;
+        info.primID = tri.primID;
+        info.t = t;
+        info.u = u;
+        info.v = v;
+        info.p = barycentric(v0, v1, v2, u, v);
+        info.frameNg = Frame(glm::normalize(glm::cross(v1 - v0, v2 - v0)));
+        info.frameNs = Frame(glm::normalize(barycentric(n0, n1, n2, info.u, info.v)));
+        info.wo = info.frameNs.toLocal(-ray.d);
+        info.matID = s.mesh.material_ids[info.primID];
     }
 };
 
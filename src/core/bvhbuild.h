@@ -0,0 +1,805 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include "core.h"
+#include "parallel.h"
+#include "bvh.h"
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * BVH construction settings.
+ */
+struct BVHBuildSettings {
+    bool sah = true;                // Binned surface area heuristic splits, or centroid midpoint splits
+    uint32_t leafSize = 4;          // Maximum number of primitives in a leaf
+    uint32_t bins = 16;             // SAH candidate bins per axis
+    float intersectionCost = 1.f;   // SAH cost of a primitive test, relative to a node traversal
+    uint32_t width = 2;             // Children per node used for traversal (2, or 4 and 8 after collapsing)
+    bool quantized = false;         // Collapsed trees store child bounds on 8 bits (leaves of at most 255 primitives)
+    float spatialSplitBudget = 0.f; // SAH builds of triangles may also split them between children (SBVH), adding up
+                                    // to this fraction of the primitives as extra references (0: object splits only)
+    bool morton = false;            // Linear BVH: primitives sorted along a Morton curve, split where their codes
+                                    // differ (sah is ignored)
+    EBVHLayout layout = EDepthFirstLayout;  // Node order of the traversed tree
+};
+
+/**
+ * Builds the binary BVH traversed by BVH::getIntersection, over primitives given by their bounds and centroids.
+ * Triangle primitives may give their vertices (three per primitive) for spatial splits.
+ *  - The build partitions primitive indices, which end up in leaf order.
+ *  - Nodes are emitted depth-first, left child first: the left child of a node follows it and the right child
+ *    is found rightOffset nodes further. Offsets are relative, so subtrees built separately can be concatenated.
+ *  - With a thread pool, the top of the tree is built by concurrent tasks. The tree is the same whatever the
+ *    number of threads.
+ *  - Spatial splits (SBVH) build from references to parts of triangles instead, see buildSpatialRecursive.
+ *  - Linear BVHs sort the primitives by the Morton code of their centroid first, nodes then split their range
+ *    where the highest differing bit changes. No bounds are computed while splitting, the tree is refit from its
+ *    leaves once built.
+ */
+class BVHBuilder {
+  public:
+    BVHBuilder(std::vector<BBox> primBoxes, std::vector<v3f> primCentroids,
+               const BVHBuildSettings& settings = BVHBuildSettings(), ThreadPool* pool = nullptr,
+               std::vector<v3f> primVertices = std::vector<v3f>())
+        : settings(settings), pool(pool), boxes(std::move(primBoxes)), centroids(std::move(primCentroids)),
+          vertices(std::move(primVertices)) { }
+
+    /**
+     * Builds the tree, with its primitive indices in leaf order. The build data is released.
+     */
+    std::unique_ptr<BVH> build() {
+        const uint32_t n = uint32_t(boxes.size());
+        std::vector<BVHFlatNode> buildNodes;
+        if (n > 0 && settings.sah && settings.spatialSplitBudget > 0.f && vertices.size() == 3 * size_t(n)) {
+            std::vector<SpatialRef> refs(n);
+            BBox bb = boxes[0];
+            for (uint32_t i = 0; i < n; i++) {
+                refs[i] = SpatialRef{boxes[i], i};
+                bb.expandToInclude(boxes[i]);
+            }
+            rootArea = bb.surfaceArea();
+            const double budget = std::min(double(settings.spatialSplitBudget) * n, double(UINT32_MAX - n));
+            indices.clear();
+            buildSpatialRecursive(std::move(refs), uint32_t(budget), buildNodes, indices);
+
+            // Inner nodes cover the references of their children
+            for (size_t i = buildNodes.size(); i-- > 0;) {
+                BVHFlatNode& node = buildNodes[i];
+                if (node.rightOffset == 0) continue;
+                node.start = buildNodes[i + 1].start;
+                node.nPrims = buildNodes[i + 1].nPrims + buildNodes[i + node.rightOffset].nPrims;
+            }
+        } else if (n > 0) {
+            indices.resize(n);
+            for (uint32_t i = 0; i < n; i++) indices[i] = i;
+            if (settings.morton) sortMorton();
+            buildRecursive(0, n, buildNodes);
+        }
+
+        // Leaf count and depth (which bounds the traversal stack size)
+        uint32_t leaves = 0, maxDepth = 0;
+        std::vector<uint32_t> depths(buildNodes.size(), 0);
+        for (size_t i = 0; i < buildNodes.size(); i++) {
+            const BVHFlatNode& node = buildNodes[i];
+            maxDepth = std::max(maxDepth, depths[i]);
+            if (node.rightOffset == 0) {
+                leaves++;
+                continue;
+            }
+            depths[i + 1] = depths[i + node.rightOffset] = depths[i] + 1;
+        }
+
+        AlignedArray<BVHFlatNode> tree;
+        tree.assign(buildNodes.begin(), buildNodes.end());
+        std::unique_ptr<BVH> bvh(new BVH(std::move(tree), leaves, maxDepth));
+        if (settings.morton && n > 0) {
+            std::vector<BBox> leafBoxes(n);
+            parallelChunks(0, n, [&](uint32_t begin, uint32_t end, size_t) {
+                for (uint32_t k = begin; k < end; k++) leafBoxes[k] = boxes[indices[k]];
+            });
+            refit(*bvh, leafBoxes, pool);
+        }
+        bvh->indices = std::move(indices);
+        indices = std::vector<uint32_t>();
+        boxes = std::vector<BBox>();
+        centroids = std::vector<v3f>();
+        vertices = std::vector<v3f>();
+        mortonCodes = std::vector<uint32_t>();
+        return bvh;
+    }
+
+    /**
+     * Updates the bounds after primitives moved, with the same topology: leaves take the union of the bounds of
+     * their primitives (given in leaf order), inner nodes the union of their children. With a thread pool, large
+     * subtrees are refit concurrently.
+     */
+    static void refit(BVH& bvh, const std::vector<BBox>& leafBoxes, ThreadPool* pool = nullptr) {
+        if (!bvh.flatTree.empty()) refitRecursive(bvh, 0, leafBoxes, pool);
+    }
+
+    /**
+     * Reorders the nodes depth-first with the child of larger surface area, the more likely to be hit by a random
+     * ray, right after its parent. The other layouts do not fit the binary tree, whose left children follow their
+     * parent.
+     */
+    static void orderByArea(BVH& bvh) {
+        struct Entry {
+            uint32_t id;
+            size_t parent;      // Index of the parent node in the new order
+            bool right;
+        };
+        const AlignedArray<BVHFlatNode>& flatTree = bvh.flatTree;
+        std::vector<BVHFlatNode> ordered;
+        ordered.reserve(flatTree.size());
+        std::vector<Entry> todo;
+        if (!flatTree.empty()) todo.push_back(Entry{0, 0, false});
+        while (!todo.empty()) {
+            const Entry e = todo.back();
+            todo.pop_back();
+            const size_t id = ordered.size();
+            if (e.right) ordered[e.parent].rightOffset = uint32_t(id - e.parent);
+            const BVHFlatNode& node = flatTree[e.id];
+            ordered.push_back(node);
+            if (node.rightOffset == 0) continue;
+            uint32_t first = e.id + 1, second = e.id + node.rightOffset;
+            if (flatTree[second].bbox.surfaceArea() > flatTree[first].bbox.surfaceArea()) std::swap(first, second);
+            todo.push_back(Entry{second, id, true});
+            todo.push_back(Entry{first, id, false});
+        }
+        bvh.flatTree.assign(ordered.begin(), ordered.end());
+    }
+
+    /**
+     * Expected cost of a random ray query according to the surface area heuristic: node traversals and primitive
+     * tests weighted by the probability of hitting their bounds.
+     */
+    static float sahCost(const BVH& bvh, float intersectionCost) {
+        const AlignedArray<BVHFlatNode>& flatTree = bvh.flatTree;
+        if (flatTree.empty()) return 0.f;
+        float cost = 0.f;
+        for (size_t i = 0; i < flatTree.size(); i++) {
+            const BVHFlatNode& node = flatTree[i];
+            cost += node.bbox.surfaceArea() * (node.rightOffset == 0 ? intersectionCost * float(node.nPrims) : 1.f);
+        }
+        return cost / flatTree[0].bbox.surfaceArea();
+    }
+
+  private:
+    // Subtrees at least this large are built as concurrent tasks, with parallel binning above binningThreshold
+    static const uint32_t parallelThreshold = 4096;
+    static const uint32_t binningThreshold = 65536;
+
+    // Spatial splits are only tried where the children of the best object split overlap by more
+    // than this fraction of the root area
+    static constexpr float splitOverlap = 1e-5f;
+
+    BVHBuildSettings settings;
+    ThreadPool* pool;
+    std::vector<BBox> boxes;
+    std::vector<v3f> centroids;
+    std::vector<v3f> vertices;          // Triangle vertices, for spatial splits
+    std::vector<uint32_t> indices;      // Primitives in leaf order
+    std::vector<uint32_t> mortonCodes;  // Linear BVH, in leaf order
+    float rootArea = 0.f;
+
+    static void refitRecursive(BVH& bvh, uint32_t id, const std::vector<BBox>& leafBoxes, ThreadPool* pool) {
+        BVHFlatNode& node = bvh.flatTree[id];
+        if (!pool || node.rightOffset == 0 || node.nPrims < parallelThreshold) {
+            refitSerial(bvh, id, leafBoxes);
+            return;
+        }
+        ThreadPool::TaskGroup group;
+        pool->run(group, [&bvh, id, &leafBoxes, pool]() { refitRecursive(bvh, id + 1, leafBoxes, pool); });
+        refitRecursive(bvh, id + node.rightOffset, leafBoxes, pool);
+        pool->wait(group);
+        node.bbox = bvh.flatTree[id + 1].bbox;
+        node.bbox.expandToInclude(bvh.flatTree[id + node.rightOffset].bbox);
+    }
+
+    /**
+     * Refits the subtree rooted at id. Subtrees are contiguous in depth-first order, and children follow their
+     * parent, so visiting the range backwards updates children first.
+     */
+    static void refitSerial(BVH& bvh, uint32_t id, const std::vector<BBox>& leafBoxes) {
+        AlignedArray<BVHFlatNode>& flatTree = bvh.flatTree;
+        uint32_t last = id;
+        while (flatTree[last].rightOffset != 0) last += flatTree[last].rightOffset;
+        for (uint32_t i = last + 1; i-- > id;) {
+            BVHFlatNode& node = flatTree[i];
+            if (node.rightOffset == 0) {
+                node.bbox = leafBoxes[node.start];
+                for (uint32_t p = node.start + 1; p < node.start + node.nPrims; p++)
+                    node.bbox.expandToInclude(leafBoxes[p]);
+            } else {
+                node.bbox = flatTree[i + 1].bbox;
+                node.bbox.expandToInclude(flatTree[i + node.rightOffset].bbox);
+            }
+        }
+    }
+
+    /**
+     * Appends the subtree of primitives [start, end) to nodes.
+     * Large subtrees build their two children concurrently, then concatenate them.
+     */
+    void buildRecursive(uint32_t start, uint32_t end, std::vector<BVHFlatNode>& nodes) {
+        if (!pool || end - start < parallelThreshold) {
+            buildSerial(start, end, nodes);
+            return;
+        }
+
+        BVHFlatNode node;
+        BBox bc;
+        if (!settings.morton) computeBounds(start, end, node.bbox, bc);
+        node.start = start;
+        node.nPrims = end - start;
+        node.rightOffset = 0;
+        const uint32_t mid = split(start, end, node.bbox, bc);
+        const size_t id = nodes.size();
+        nodes.push_back(node);
+        if (mid == start) return;
+
+        std::vector<BVHFlatNode> left, right;
+        ThreadPool::TaskGroup group;
+        pool->run(group, [this, start, mid, &left]() { buildRecursive(start, mid, left); });
+        buildRecursive(mid, end, right);
+        pool->wait(group);
+
+        nodes[id].rightOffset = uint32_t(1 + left.size());
+        nodes.insert(nodes.end(), left.begin(), left.end());
+        nodes.insert(nodes.end(), right.begin(), right.end());
+    }
+
+    /**
+     * Appends the subtree of primitives [start, end) to nodes, using an explicit stack.
+     */
+    void buildSerial(uint32_t start, uint32_t end, std::vector<BVHFlatNode>& nodes) {
+        struct BuildEntry {
+            uint32_t start, end;
+            size_t parent;      // Index of the parent node
+            bool right;         // Whether this is the right child of its parent
+        };
+        std::vector<BuildEntry> todo;
+        todo.push_back(BuildEntry{start, end, 0, false});
+
+        while (!todo.empty()) {
+            const BuildEntry entry = todo.back();
+            todo.pop_back();
+
+            // Bounds of the node (linear BVHs are refit once built)
+            BVHFlatNode node;
+            BBox bc;
+            if (!settings.morton) computeBounds(entry.start, entry.end, node.bbox, bc);
+            node.start = entry.start;
+            node.nPrims = entry.end - entry.start;
+            node.rightOffset = 0;
+
+            // The right child sets up the offset of its parent
+            const size_t id = nodes.size();
+            if (entry.right) nodes[entry.parent].rightOffset = uint32_t(id - entry.parent);
+
+            const uint32_t mid = split(entry.start, entry.end, node.bbox, bc);
+            nodes.push_back(node);
+
+            // Leaves have a zero offset
+            if (mid == entry.start) continue;
+
+            // Push right child, then left child (processed first)
+            todo.push_back(BuildEntry{mid, entry.end, id, true});
+            todo.push_back(BuildEntry{entry.start, mid, id, false});
+        }
+    }
+
+    /**
+     * Bounds of the primitives and of their centroids.
+     */
+    void computeBounds(uint32_t start, uint32_t end, BBox& bb, BBox& bc) const {
+        std::vector<BBox> chunkBoxes, chunkCentroids;
+        const size_t nChunks = parallelChunks(start, end, [&](uint32_t begin, uint32_t end, size_t chunk) {
+            BBox b(boxes[indices[begin]]), c(centroids[indices[begin]]);
+            for (uint32_t p = begin + 1; p < end; p++) {
+                b.expandToInclude(boxes[indices[p]]);
+                c.expandToInclude(centroids[indices[p]]);
+            }
+            chunkBoxes[chunk] = b;
+            chunkCentroids[chunk] = c;
+        }, [&](size_t nChunks) {
+            chunkBoxes.resize(nChunks);
+            chunkCentroids.resize(nChunks);
+        });
+        bb = chunkBoxes[0];
+        bc = chunkCentroids[0];
+        for (size_t i = 1; i < nChunks; i++) {
+            bb.expandToInclude(chunkBoxes[i]);
+            bc.expandToInclude(chunkCentroids[i]);
+        }
+    }
+
+    /**
+     * Returns the first index of the right child, or start for a leaf.
+     */
+    uint32_t split(uint32_t start, uint32_t end, const BBox& bb, const BBox& bc) {
+        if (settings.morton) return splitMorton(start, end);
+        return settings.sah ? splitSAH(start, end, bb, bc) : splitMidpoint(start, end, bc);
+    }
+
+    /**
+     * Sorts the primitives by the Morton code of their centroid in the centroid bounds, 10 bits per axis.
+     */
+    void sortMorton() {
+        const uint32_t n = uint32_t(indices.size());
+        BBox bb, bc;
+        computeBounds(0, n, bb, bc);
+        v3f scale;
+        for (uint32_t dim = 0; dim < 3; dim++) {
+            const float extent = bc.max[dim] - bc.min[dim];
+            scale[dim] = extent > 0.f ? 1024.f / extent : 0.f;
+        }
+        mortonCodes.resize(n);
+        parallelChunks(0, n, [&](uint32_t begin, uint32_t end, size_t) {
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t code = 0;
+                for (uint32_t dim = 0; dim < 3; dim++) {
+                    const float x = (centroids[i][dim] - bc.min[dim]) * scale[dim];
+                    code |= spreadBits(uint32_t(std::min(std::max(x, 0.f), 1023.f))) << (2 - dim);
+                }
+                mortonCodes[i] = code;
+            }
+        });
+        radixSort(mortonCodes, indices, pool, 30);
+    }
+
+    /**
+     * Spreads the 10 low bits of x to every third bit.
+     */
+    static uint32_t spreadBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    /**
+     * Splits the sorted range where the highest bit differing between its Morton codes gets set, or in the
+     * middle if the codes are equal.
+     */
+    uint32_t splitMorton(uint32_t start, uint32_t end) const {
+        if (end - start <= settings.leafSize) return start;
+        uint32_t bit = mortonCodes[start] ^ mortonCodes[end - 1];
+        if (bit == 0) return start + (end - start) / 2;
+        while (bit & (bit - 1)) bit &= bit - 1;
+
+        // The codes of the range share the bits above, so the ones with the bit set come last
+        const uint32_t* mid = std::partition_point(&mortonCodes[start], &mortonCodes[start] + (end - start),
+                                                   [bit](uint32_t code) { return (code & bit) == 0; });
+        return uint32_t(mid - mortonCodes.data());
+    }
+
+    /**
+     * Splits at the center of the longest axis of the centroid bounds, or in the middle of the range if all
+     * the centroids fall on the same side.
+     */
+    uint32_t splitMidpoint(uint32_t start, uint32_t end, const BBox& bc) {
+        if (end - start <= settings.leafSize) return start;
+
+        const uint32_t dim = bc.maxDimension();
+        const float coord = .5f * (bc.min[dim] + bc.max[dim]);
+        uint32_t mid = start;
+        for (uint32_t i = start; i < end; i++) {
+            if (centroids[indices[i]][dim] < coord) {
+                std::swap(indices[i], indices[mid]);
+                mid++;
+            }
+        }
+        if (mid == start || mid == end) mid = start + (end - start) / 2;
+        return mid;
+    }
+
+    /**
+     * Primitive counts and bounds of the centroid bins of the three axes.
+     */
+    struct Bins {
+        std::vector<BBox> boxes;
+        std::vector<uint32_t> counts;
+
+        explicit Bins(uint32_t nBins) : boxes(3 * nBins, BBox::empty()), counts(3 * nBins, 0) { }
+
+        void add(uint32_t i, const BBox& b) {
+            boxes[i].expandToInclude(b);
+            counts[i]++;
+        }
+    };
+
+    /**
+     * Evaluates settings.bins candidate planes per axis with the surface area heuristic and splits at the
+     * cheapest one. Primitives are binned by centroid, in parallel for large nodes.
+     */
+    uint32_t splitSAH(uint32_t start, uint32_t end, const BBox& bb, const BBox& bc) {
+        const uint32_t nPrims = end - start;
+        if (nPrims <= 1) return start;
+
+        const uint32_t nBins = std::max(2u, settings.bins);
+        float scale[3];
+        for (uint32_t dim = 0; dim < 3; dim++) {
+            const float extent = bc.max[dim] - bc.min[dim];
+            scale[dim] = extent > 0.f ? float(nBins) / extent : 0.f;
+        }
+
+        // Bin all three axes in one pass over the primitives
+        auto binRange = [&](uint32_t begin, uint32_t end, Bins& bins) {
+            for (uint32_t i = begin; i < end; i++) {
+                const uint32_t prim = indices[i];
+                for (uint32_t dim = 0; dim < 3; dim++)
+                    if (scale[dim] > 0.f)
+                        bins.add(dim * nBins + binIndex(centroids[prim][dim], bc.min[dim], scale[dim], nBins),
+                                 boxes[prim]);
+            }
+        };
+        Bins bins(nBins);
+        if (pool && nPrims >= binningThreshold) {
+            std::vector<Bins> chunkBins;
+            const size_t nChunks = parallelChunks(start, end, [&](uint32_t begin, uint32_t end, size_t chunk) {
+                binRange(begin, end, chunkBins[chunk]);
+            }, [&](size_t nChunks) { chunkBins.assign(nChunks, Bins(nBins)); });
+            for (size_t chunk = 0; chunk < nChunks; chunk++)
+                for (uint32_t i = 0; i < 3 * nBins; i++) {
+                    bins.boxes[i].expandToInclude(chunkBins[chunk].boxes[i]);
+                    bins.counts[i] += chunkBins[chunk].counts[i];
+                }
+        } else {
+            binRange(start, end, bins);
+        }
+
+        // Costs are scaled by the node area: C = A * Ct + Ci * sum(A_child * N_child)
+        const float leafCost = bb.surfaceArea() * settings.intersectionCost * float(nPrims);
+        float bestCost = std::numeric_limits<float>::infinity();
+        uint32_t bestDim = 0, bestBin = 0;
+        for (uint32_t dim = 0; dim < 3; dim++)
+            if (scale[dim] > 0.f)
+                sweepBins(&bins.boxes[dim * nBins], &bins.counts[dim * nBins], &bins.counts[dim * nBins], nBins, dim,
+                          bb.surfaceArea(), UINT32_MAX, bestCost, bestDim, bestBin);
+
+        // All centroids coincide: split in the middle if the leaf would be too large
+        if (bestBin == 0) return nPrims <= settings.leafSize ? start : start + nPrims / 2;
+
+        // Keep a leaf when it is cheaper than the best split and small enough
+        if (nPrims <= settings.leafSize && leafCost <= bestCost) return start;
+
+        uint32_t* mid = std::partition(&indices[start], &indices[start] + nPrims, [&](uint32_t i) {
+            return binIndex(centroids[i][bestDim], bc.min[bestDim], scale[bestDim], nBins) < bestBin;
+        });
+        return uint32_t(mid - indices.data());
+    }
+
+    /**
+     * Sweeps the planes between the bins of axis dim and keeps the cheapest one in (bestCost, bestDim, bestBin).
+     * Plane b lies between bins b-1 and b: primitives starting in bins left of it go to the left child, those
+     * ending in bins right of it to the right child (the same bin for object splits). Planes giving more than
+     * maxRefs references in total are skipped.
+     */
+    void sweepBins(const BBox* binBoxes, const uint32_t* entries, const uint32_t* exits, uint32_t nBins, uint32_t dim,
+                   float nodeArea, uint32_t maxRefs, float& bestCost, uint32_t& bestDim, uint32_t& bestBin) const {
+        // Sweep from the right: bounds and count of the bins right of every plane
+        std::vector<BBox> rightBoxes(nBins);
+        std::vector<uint32_t> rightCounts(nBins);
+        BBox right = BBox::empty();
+        uint32_t rightCount = 0;
+        for (uint32_t b = nBins - 1; b > 0; b--) {
+            right.expandToInclude(binBoxes[b]);
+            rightCount += exits[b];
+            rightBoxes[b] = right;
+            rightCounts[b] = rightCount;
+        }
+
+        // Sweep from the left
+        BBox left = BBox::empty();
+        uint32_t leftCount = 0;
+        for (uint32_t b = 1; b < nBins; b++) {
+            left.expandToInclude(binBoxes[b - 1]);
+            leftCount += entries[b - 1];
+            if (leftCount == 0 || rightCounts[b] == 0 || uint64_t(leftCount) + rightCounts[b] > maxRefs) continue;
+            const float childCost = left.surfaceArea() * float(leftCount) +
+                                    rightBoxes[b].surfaceArea() * float(rightCounts[b]);
+            const float cost = nodeArea + settings.intersectionCost * childCost;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestDim = dim;
+                bestBin = b;
+            }
+        }
+    }
+
+    /**
+     * Reference to the part of a triangle inside box, built by spatial splits.
+     */
+    struct SpatialRef {
+        BBox box;
+        uint32_t prim;
+    };
+
+    /**
+     * Spatial split build (SBVH, Stich et al. 2009).
+     *  - Nodes hold references to triangles, with the bounds of the part of the triangle they cover. Besides
+     *    binned object splits, a node may be split by a plane, cutting the references crossing it in two: their
+     *    children overlap less, at the cost of testing some triangles in several leaves.
+     *  - A node may add up to budget references to its subtree. What it does not use is shared by its children
+     *    in proportion to their reference counts, so the tree does not depend on the threads.
+     *  - Leaves are appended to prims in depth-first order. Subtrees built concurrently use their own arrays,
+     *    and their leaf starts are shifted when concatenated.
+     */
+    void buildSpatialRecursive(std::vector<SpatialRef> refs, uint32_t budget, std::vector<BVHFlatNode>& nodes,
+                               std::vector<uint32_t>& prims) {
+        if (!pool || refs.size() < parallelThreshold) {
+            buildSpatialSerial(std::move(refs), budget, nodes, prims);
+            return;
+        }
+
+        BVHFlatNode node;
+        std::vector<SpatialRef> leftRefs, rightRefs;
+        uint32_t leftBudget, rightBudget;
+        if (!splitSpatial(refs, budget, node, leftRefs, rightRefs, leftBudget, rightBudget)) {
+            makeSpatialLeaf(refs, node, prims);
+            nodes.push_back(node);
+            return;
+        }
+        refs = std::vector<SpatialRef>();
+        const size_t id = nodes.size();
+        nodes.push_back(node);
+
+        std::vector<BVHFlatNode> left, right;
+        std::vector<uint32_t> leftPrims, rightPrims;
+        ThreadPool::TaskGroup group;
+        pool->run(group, [this, &leftRefs, leftBudget, &left, &leftPrims]() {
+            buildSpatialRecursive(std::move(leftRefs), leftBudget, left, leftPrims);
+        });
+        buildSpatialRecursive(std::move(rightRefs), rightBudget, right, rightPrims);
+        pool->wait(group);
+
+        nodes[id].rightOffset = uint32_t(1 + left.size());
+        const uint32_t leftStart = uint32_t(prims.size()), rightStart = uint32_t(leftStart + leftPrims.size());
+        for (BVHFlatNode& child : left) child.start += leftStart;
+        for (BVHFlatNode& child : right) child.start += rightStart;
+        nodes.insert(nodes.end(), left.begin(), left.end());
+        nodes.insert(nodes.end(), right.begin(), right.end());
+        prims.insert(prims.end(), leftPrims.begin(), leftPrims.end());
+        prims.insert(prims.end(), rightPrims.begin(), rightPrims.end());
+    }
+
+    /**
+     * Spatial split build of a subtree, using an explicit stack.
+     */
+    void buildSpatialSerial(std::vector<SpatialRef> refs, uint32_t budget, std::vector<BVHFlatNode>& nodes,
+                            std::vector<uint32_t>& prims) {
+        struct BuildEntry {
+            std::vector<SpatialRef> refs;
+            uint32_t budget;
+            size_t parent;      // Index of the parent node
+            bool right;         // Whether this is the right child of its parent
+        };
+        std::vector<BuildEntry> todo;
+        todo.push_back(BuildEntry{std::move(refs), budget, 0, false});
+
+        while (!todo.empty()) {
+            BuildEntry entry = std::move(todo.back());
+            todo.pop_back();
+
+            const size_t id = nodes.size();
+            if (entry.right) nodes[entry.parent].rightOffset = uint32_t(id - entry.parent);
+
+            BVHFlatNode node;
+            std::vector<SpatialRef> left, right;
+            uint32_t leftBudget, rightBudget;
+            if (!splitSpatial(entry.refs, entry.budget, node, left, right, leftBudget, rightBudget)) {
+                makeSpatialLeaf(entry.refs, node, prims);
+                nodes.push_back(node);
+                continue;
+            }
+            nodes.push_back(node);
+
+            // Push right child, then left child (processed first)
+            todo.push_back(BuildEntry{std::move(right), rightBudget, id, true});
+            todo.push_back(BuildEntry{std::move(left), leftBudget, id, false});
+        }
+    }
+
+    /**
+     * Sets the node bounds and splits its references with the cheapest object or spatial split.
+     * Returns false if the node should be a leaf.
+     */
+    bool splitSpatial(const std::vector<SpatialRef>& refs, uint32_t budget, BVHFlatNode& node,
+                      std::vector<SpatialRef>& left, std::vector<SpatialRef>& right,
+                      uint32_t& leftBudget, uint32_t& rightBudget) const {
+        const uint32_t nRefs = uint32_t(refs.size());
+        BBox bb = BBox::empty(), bc = BBox::empty();
+        for (const SpatialRef& ref : refs) {
+            bb.expandToInclude(ref.box);
+            bc.expandToInclude(.5f * (ref.box.min + ref.box.max));
+        }
+        node.bbox = bb;
+        node.start = 0;
+        node.nPrims = nRefs;
+        node.rightOffset = 0;
+        if (nRefs <= 1) return false;
+
+        // Object split, binned by the centers of the references
+        const uint32_t nBins = std::max(2u, settings.bins);
+        float scale[3];
+        for (uint32_t dim = 0; dim < 3; dim++) {
+            const float extent = bc.max[dim] - bc.min[dim];
+            scale[dim] = extent > 0.f ? float(nBins) / extent : 0.f;
+        }
+        Bins bins(nBins);
+        for (const SpatialRef& ref : refs) {
+            const v3f c = .5f * (ref.box.min + ref.box.max);
+            for (uint32_t dim = 0; dim < 3; dim++)
+                if (scale[dim] > 0.f) bins.add(dim * nBins + binIndex(c[dim], bc.min[dim], scale[dim], nBins), ref.box);
+        }
+        float objectCost = std::numeric_limits<float>::infinity();
+        uint32_t objectDim = 0, objectBin = 0;
+        for (uint32_t dim = 0; dim < 3; dim++)
+            if (scale[dim] > 0.f)
+                sweepBins(&bins.boxes[dim * nBins], &bins.counts[dim * nBins], &bins.counts[dim * nBins], nBins, dim,
+                          bb.surfaceArea(), UINT32_MAX, objectCost, objectDim, objectBin);
+
+        // Spatial split, only worth it where the object split children overlap
+        float spatialCost = std::numeric_limits<float>::infinity();
+        uint32_t spatialDim = 0, spatialBin = 0;
+        BBox overlap = BBox::empty();
+        if (objectBin > 0) {
+            BBox l = BBox::empty(), r = BBox::empty();
+            for (uint32_t b = 0; b < nBins; b++)
+                (b < objectBin ? l : r).expandToInclude(bins.boxes[objectDim * nBins + b]);
+            overlap = BBox(glm::max(l.min, r.min), glm::min(l.max, r.max));
+        }
+        if (budget > 0 && (objectBin == 0 || (!overlap.isEmpty() && overlap.surfaceArea() > splitOverlap * rootArea))) {
+            const float inf = std::numeric_limits<float>::infinity();
+            std::vector<BBox> binBoxes(nBins);
+            std::vector<uint32_t> entries(nBins), exits(nBins);
+            for (uint32_t dim = 0; dim < 3; dim++) {
+                const float extent = bb.max[dim] - bb.min[dim];
+                if (extent <= 0.f) continue;
+                const float binScale = float(nBins) / extent;
+                std::fill(binBoxes.begin(), binBoxes.end(), BBox::empty());
+                std::fill(entries.begin(), entries.end(), 0u);
+                std::fill(exits.begin(), exits.end(), 0u);
+                for (const SpatialRef& ref : refs) {
+                    const uint32_t b0 = binIndex(ref.box.min[dim], bb.min[dim], binScale, nBins);
+                    const uint32_t b1 = binIndex(ref.box.max[dim], bb.min[dim], binScale, nBins);
+                    entries[b0]++;
+                    exits[b1]++;
+                    if (b0 == b1) {
+                        binBoxes[b0].expandToInclude(ref.box);
+                        continue;
+                    }
+                    for (uint32_t b = b0; b <= b1; b++)
+                        binBoxes[b].expandToInclude(clipTriangle(ref, dim, b == b0 ? -inf : splitPlane(bb, dim, b),
+                                                                 b == b1 ? inf : splitPlane(bb, dim, b + 1)));
+                }
+                sweepBins(binBoxes.data(), entries.data(), exits.data(), nBins, dim, bb.surfaceArea(),
+                          uint32_t(std::min(uint64_t(nRefs) + budget, uint64_t(UINT32_MAX))), spatialCost, spatialDim,
+                          spatialBin);
+            }
+        }
+
+        // Keep a leaf when it is cheaper than the best split and small enough
+        const float leafCost = bb.surfaceArea() * settings.intersectionCost * float(nRefs);
+        if (nRefs <= settings.leafSize && leafCost <= std::min(objectCost, spatialCost)) return false;
+
+        if (spatialBin > 0 && spatialCost < objectCost) {
+            const float inf = std::numeric_limits<float>::infinity();
+            const float binScale = float(nBins) / (bb.max[spatialDim] - bb.min[spatialDim]);
+            const float plane = splitPlane(bb, spatialDim, spatialBin);
+            for (const SpatialRef& ref : refs) {
+                if (binIndex(ref.box.max[spatialDim], bb.min[spatialDim], binScale, nBins) < spatialBin) {
+                    left.push_back(ref);
+                } else if (binIndex(ref.box.min[spatialDim], bb.min[spatialDim], binScale, nBins) >= spatialBin) {
+                    right.push_back(ref);
+                } else {
+                    const SpatialRef l = {clipTriangle(ref, spatialDim, -inf, plane), ref.prim};
+                    const SpatialRef r = {clipTriangle(ref, spatialDim, plane, inf), ref.prim};
+                    if (!l.box.isEmpty()) left.push_back(l);
+                    if (!r.box.isEmpty()) right.push_back(r);
+                    if (l.box.isEmpty() && r.box.isEmpty())
+                        (ref.box.min[spatialDim] < plane ? left : right).push_back(ref);
+                }
+            }
+        } else if (objectBin > 0) {
+            for (const SpatialRef& ref : refs) {
+                const float c = .5f * (ref.box.min[objectDim] + ref.box.max[objectDim]);
+                (binIndex(c, bc.min[objectDim], scale[objectDim], nBins) < objectBin ? left : right).push_back(ref);
+            }
+        }
+
+        // All centers coincide, or clipping emptied a side: split in the middle if the leaf would be too large
+        if (left.empty() || right.empty()) {
+            if (nRefs <= settings.leafSize) return false;
+            left.assign(refs.begin(), refs.begin() + nRefs / 2);
+            right.assign(refs.begin() + nRefs / 2, refs.end());
+        }
+
+        // Share the remaining budget
+        const uint64_t children = left.size() + right.size();
+        const uint32_t remaining = uint32_t(budget - std::min(uint64_t(budget), children - nRefs));
+        leftBudget = uint32_t(uint64_t(remaining) * left.size() / children);
+        rightBudget = remaining - leftBudget;
+        return true;
+    }
+
+    /**
+     * Leaf over the references, several parts of the same triangle are tested once.
+     */
+    void makeSpatialLeaf(std::vector<SpatialRef>& refs, BVHFlatNode& node, std::vector<uint32_t>& prims) const {
+        node.start = uint32_t(prims.size());
+        for (const SpatialRef& ref : refs) prims.push_back(ref.prim);
+        std::sort(prims.begin() + node.start, prims.end());
+        prims.erase(std::unique(prims.begin() + node.start, prims.end()), prims.end());
+        node.nPrims = uint32_t(prims.size() - node.start);
+    }
+
+    /**
+     * Position of the plane before spatial bin b of axis dim, in a node with bounds bb.
+     */
+    float splitPlane(const BBox& bb, uint32_t dim, uint32_t b) const {
+        return bb.min[dim] + (bb.max[dim] - bb.min[dim]) * float(b) / float(std::max(2u, settings.bins));
+    }
+
+    /**
+     * Bounds of the part of the referenced triangle between the planes lo and hi of axis dim.
+     */
+    BBox clipTriangle(const SpatialRef& ref, uint32_t dim, float lo, float hi) const {
+        BBox b = BBox::empty();
+        const v3f* v = &vertices[3 * size_t(ref.prim)];
+        for (int i = 0; i < 3; i++) {
+            const v3f& p = v[i];
+            const v3f& q = v[(i + 1) % 3];
+            if (p[dim] >= lo && p[dim] <= hi) b.expandToInclude(p);
+            for (const float plane : {lo, hi}) {
+                if ((p[dim] < plane && q[dim] > plane) || (p[dim] > plane && q[dim] < plane)) {
+                    v3f x = p + (q - p) * ((plane - p[dim]) / (q[dim] - p[dim]));
+                    x[dim] = plane;
+                    b.expandToInclude(x);
+                }
+            }
+        }
+        return BBox(glm::max(b.min, ref.box.min), glm::min(b.max, ref.box.max));
+    }
+
+    /**
+     * Calls f(begin, end, chunk) over chunks of [start, end), on the thread pool for large ranges.
+     * init(nChunks) is called first to allocate per-chunk results. Returns the number of chunks.
+     */
+    template<class F, class Init>
+    size_t parallelChunks(uint32_t start, uint32_t end, const F& f, const Init& init) const {
+        const uint32_t n = end - start;
+        const size_t nChunks = pool && n >= binningThreshold ?
+                               std::min(size_t(pool->size()) * 4, size_t(n / (binningThreshold / 16))) : 1;
+        init(nChunks);
+        if (nChunks == 1) {
+            f(start, end, 0);
+            return 1;
+        }
+        pool->parallelFor(nChunks, [&](size_t chunk) {
+            f(uint32_t(start + n * chunk / nChunks), uint32_t(start + n * (chunk + 1) / nChunks), chunk);
+        });
+        return nChunks;
+    }
+
+    template<class F>
+    size_t parallelChunks(uint32_t start, uint32_t end, const F& f) const {
+        return parallelChunks(start, end, f, [](size_t) { });
+    }
+
+    static uint32_t binIndex(float c, float min, float scale, uint32_t nBins) {
+        const int b = int((c - min) * scale);
+        return uint32_t(std::min(std::max(b, 0), int(nBins) - 1));
+    }
+};
+
+TR_NAMESPACE_END
@@ -0,0 +1,94 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <core/platform.h>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Traversal work of the BVH queries, per query type (closest hit, occlusion).
+ * Nodes visited by a packet of rays are counted once for the whole packet.
+ */
+struct BVHCounters {
+    uint64_t rays[2] = {};
+    uint64_t nodes[2] = {};         // Node records fetched, from the binary or the wide tree
+    uint64_t triangles[2] = {};     // Ray-triangle tests
+};
+
+/**
+ * Per-thread traversal counters, only compiled in with TR_BVH_STATS (CMake option TINYRENDER_BVH_STATS).
+ * Otherwise the counting functions are empty and traversal code is unchanged.
+ * Every thread counts into its own block, blocks are summed by total() once the queries are done.
+ */
+struct BVHStats {
+#ifdef TR_BVH_STATS
+    static const bool enabled = true;
+
+    static void countRay(bool occlusion) { local().rays[occlusion]++; }
+    static void countNode(bool occlusion) { local().nodes[occlusion]++; }
+    static void countTriangle(bool occlusion) { local().triangles[occlusion]++; }
+
+    static BVHCounters total() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        BVHCounters sum;
+        for (const std::unique_ptr<BVHCounters>& c : r.blocks) {
+            for (int q = 0; q < 2; q++) {
+                sum.rays[q] += c->rays[q];
+                sum.nodes[q] += c->nodes[q];
+                sum.triangles[q] += c->triangles[q];
+            }
+        }
+        return sum;
+    }
+
+    static void reset() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (std::unique_ptr<BVHCounters>& c : r.blocks) *c = BVHCounters();
+    }
+
+  private:
+    // Blocks outlive their threads, so that the counts of finished threads are kept
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<BVHCounters>> blocks;
+    };
+
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    static BVHCounters& local() {
+        static thread_local BVHCounters* counters = nullptr;
+        if (!counters) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.blocks.emplace_back(new BVHCounters());
+            counters = r.blocks.back().get();
+        }
+        return *counters;
+    }
+#else
+    static const bool enabled = false;
+
+    static void countRay(bool) { }
+    static void countNode(bool) { }
+    static void countTriangle(bool) { }
+    static BVHCounters total() { return BVHCounters(); }
+    static void reset() { }
+#endif
+};
+
+TR_NAMESPACE_END
@@ -51,6 +51,38 @@ enum ERenderPass {
     ERenderPasses
 };
 
+/**
+ * Order in which the pixels of an image tile are rendered.
+ */
+enum ETileOrder {
+    EScanlineOrder = 0,
+    EMortonOrder,
+    EHilbertOrder,
+    ETileOrders
+};
+
+/**
+ * BVH construction algorithm enumeration.
+ */
+enum EAccelBuilder {
+    EMidpointBuilder = 0,
+    ESAHBuilder,
+    ESBVHBuilder,
+    ELBVHBuilder,
+    EAccelBuilders
+};
+
+/**
+ * BVH node layout enumeration (order of the nodes in memory).
+ */
+enum EBVHLayout {
+    EDepthFirstLayout = 0,
+    EBreadthFirstLayout,
+    EVanEmdeBoasLayout,
+    EAreaLayout,
+    EBVHLayouts
+};
+
 /**
  * BSDF enumeration.
  */
@@ -186,6 +218,14 @@ struct Camera {
     float fov;
 };
 
+/**
+ * Copy of an OBJ shape placed in the scene, in addition to the shape itself.
+ */
+struct ShapeInstance {
+    std::string shape;              // Name of the shape in the OBJ file
+    mat4f toWorld;
+};
+
 /**
  * Configuration structure to render a scene.
  * Stores integrator, camera setup, image plane dimensions, sample count, etc.
@@ -195,7 +235,37 @@ struct Config {
     ERenderPass renderpass;
     Camera camera;
     fs::path objFile, tomlFile;
-    int width, height, spp;
+    int width, height, spp;         // Unset spp (0) means 1 sample, or no upper bound with a time limit
+    int crop[4] = {0, 0, 0, 0};     // Rendered region [x0, x1) x [y0, y1) of the image
+    bool isCropped = false;         // Whether the rendered region is a crop of the whole image
+    int threads = 0;                // Number of render threads (0: all hardware threads)
+    int tileSize = 32;              // Side of the square image tiles handed to the threads
+    ETileOrder tileOrder = EScanlineOrder; // Pixel traversal order inside a tile
+    int seed = 260631195;           // Seed of the per-pixel sampler streams
+    int passSpp = 0;                // Samples per progressive pass (0: all samples in one pass)
+    int checkpointPasses = 0;       // Write the image every K passes (0: never)
+    float checkpointInterval = 0.f; // Write the image every T seconds (0: never)
+    float timeLimit = 0.f;          // Add passes until this many seconds have elapsed (0: no limit)
+    float noiseThreshold = 0.f;     // Stop sampling pixels whose noise estimate is below (0: no adaptive sampling)
+    int minSpp = 8;                 // Samples taken before a pixel can be considered converged
+    bool sampleCountLayer = false;  // Save the number of samples of each pixel as an extra image layer
+    bool saveState = false;         // Save a resumable render state along with each checkpoint (every 5 min by default)
+    bool resume = false;            // Resume from the saved render state, if any
+    EAccelBuilder accel = ESAHBuilder; // BVH construction algorithm
+    int bvhLeafSize = 4;            // Maximum number of triangles in a BVH leaf
+    int bvhBins = 16;               // Candidate split planes per axis of the SAH builder
+    float bvhLeafCost = 1.f;        // SAH cost of a triangle test, relative to a node traversal
+    float bvhSplitBudget = .25f;    // Extra triangle references allowed to the spatial split builder, per triangle
+    int bvhWidth = 4;               // Children per BVH node during traversal (2, 4 or 8)
+    bool bvhQuantized = false;      // 4- and 8-wide nodes with child bounds quantized to 8 bits
+    EBVHLayout bvhLayout = EDepthFirstLayout; // Order of the BVH nodes in memory
+    bool bvhCache = true;           // Save the BVH next to the OBJ file, one per settings, and map it on later runs
+    std::string bvhStatsFile;       // JSON report of the BVH after the build and the render of each frame (empty: none)
+    std::vector<ShapeInstance> instances; // Shape copies, rendered with a two-level BVH
+    std::string frames;             // Animation: printf pattern of the OBJ file of each frame (empty: still image)
+    int firstFrame = 0, lastFrame = 0;
+    float rebuildThreshold = 0.f;   // Rebuild the BVH of a frame when refitting grew its SAH cost by this factor (0: never)
+    int frame = -1;                 // Animation frame being rendered (-1: still image)
     union IntegratorConfig {
         IntegratorConfig() : di{}{};
         ~IntegratorConfig() {}
@@ -336,6 +406,30 @@ struct WorldData {
 };
 
 struct AcceleratorBVH;
+struct ThreadPool;
+
+/**
+ * Geometry of a Wavefront OBJ file and its BVH.
+ * Loaded once and shared by all the scenes rendering the same file.
+ */
+struct SceneGeometry {
+    WorldData worldData;
+    std::unique_ptr<AcceleratorBVH> bvh;
+    AABB aabb;
+
+    static fs::path getPath(const Config& config);
+    static std::string getKey(const Config& config);
+    bool load(const Config& config);
+
+    /**
+     * Replaces the vertices with those of config.objFile, which must have the same triangles (e.g. the next
+     * frame of an animation), and refits the BVH.
+     */
+    bool loadFrame(const Config& config, ThreadPool* pool);
+
+  private:
+    void computeBounds();
+};
 
 /**
  * Scene structure.
@@ -343,13 +437,14 @@ struct AcceleratorBVH;
  */
 struct Scene {
     const Config& config;
-    WorldData worldData;
-    std::unique_ptr<AcceleratorBVH> bvh;
+    std::shared_ptr<SceneGeometry> geometry;
+    const WorldData& worldData;
+    const AcceleratorBVH* bvh = nullptr;
     std::vector<Emitter> emitters;
     std::vector<std::unique_ptr<BSDF>> bsdfs;
     AABB aabb;
 
-    explicit Scene(const Config& config);
+    explicit Scene(const Config& config, std::shared_ptr<SceneGeometry> geometry = nullptr);
     bool load(bool isRealTime);
     float getShapeArea(size_t shapeID, Distribution1D& faceAreaDistribution);
     float getShapeRadius(const size_t shapeID) const;
@@ -363,6 +458,7 @@ struct Scene {
     size_t getObjectNbVertices(size_t objectIdx) const;
     int getPrimitiveID(size_t vertexIdx) const;
     int getMaterialID(size_t objectIdx, int primID) const;
+    uint64_t getHash() const;
 };
 
 /**
@@ -0,0 +1,588 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#include <core/core.h>
+#include <core/distributed.h>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+TR_NAMESPACE_BEGIN
+
+#ifndef _WIN32
+
+/**
+ * Message types of the coordinator protocol.
+ * A worker first sends EHelloMessage (thread count, settings and scene hashes), then an EResultMessage
+ * for every batch it renders. The coordinator sends ETilesMessage batches, an empty batch stops the worker.
+ */
+enum EMessage : uint32_t {
+    EHelloMessage = 1,
+    ETilesMessage,
+    EResultMessage
+};
+
+/**
+ * Message type and payload, with (de)serialization of plain values.
+ */
+struct Message {
+    uint32_t type = 0;
+    std::vector<char> data;
+    size_t offset = 0;
+
+    template<class T>
+    void put(const T* values, size_t n) {
+        const char* bytes = (const char*) values;
+        data.insert(data.end(), bytes, bytes + sizeof(T) * n);
+    }
+    template<class T>
+    void put(const T& value) { put(&value, 1); }
+
+    template<class T>
+    bool get(T* values, size_t n) {
+        if (offset + sizeof(T) * n > data.size()) return false;
+        memcpy((void*) values, data.data() + offset, sizeof(T) * n);
+        offset += sizeof(T) * n;
+        return true;
+    }
+    template<class T>
+    bool get(T& value) { return get(&value, 1); }
+};
+
+/**
+ * Connected stream socket exchanging messages.
+ * Messages are either received with blocking reads (receive), or from the bytes read so far without
+ * blocking (receiveAvailable, then popMessage), so that a peer stalling mid-message blocks nobody.
+ */
+struct Connection {
+    int fd = -1;
+    std::vector<char> input;        // Bytes read by receiveAvailable and not yet popped
+
+    bool send(const Message& m) {
+        const uint64_t size = m.data.size();
+        return sendAll(&m.type, sizeof(m.type)) && sendAll(&size, sizeof(size)) &&
+               sendAll(m.data.data(), m.data.size());
+    }
+
+    bool receive(Message& m) {
+        uint64_t size;
+        if (!recvAll(&m.type, sizeof(m.type)) || !recvAll(&size, sizeof(size))) return false;
+        if (size > (uint64_t(1) << 32)) return false;
+        m.data.resize(size_t(size));
+        m.offset = 0;
+        return recvAll(m.data.data(), m.data.size());
+    }
+
+    /**
+     * Reads the bytes available without blocking. Returns false once the peer closed the connection or on
+     * error, complete messages may still be buffered.
+     */
+    bool receiveAvailable() {
+        char buffer[1 << 16];
+        while (true) {
+            const ssize_t n = ::recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n > 0) {
+                input.insert(input.end(), buffer, buffer + n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    /**
+     * Moves the next complete message out of the buffered bytes. Returns false if it is incomplete, or
+     * invalid (and then sets invalid).
+     */
+    bool popMessage(Message& m, bool& invalid) {
+        const size_t header = sizeof(m.type) + sizeof(uint64_t);
+        if (input.size() < header) return false;
+        uint64_t size;
+        memcpy(&m.type, input.data(), sizeof(m.type));
+        memcpy(&size, input.data() + sizeof(m.type), sizeof(size));
+        if (size > (uint64_t(1) << 32)) {
+            invalid = true;
+            return false;
+        }
+        if (input.size() - header < size) return false;
+        m.data.assign(input.begin() + std::ptrdiff_t(header), input.begin() + std::ptrdiff_t(header + size));
+        m.offset = 0;
+        input.erase(input.begin(), input.begin() + std::ptrdiff_t(header + size));
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        input.clear();
+    }
+
+  private:
+    bool sendAll(const void* data, size_t size) {
+        const char* bytes = (const char*) data;
+        while (size > 0) {
+            const ssize_t n = ::send(fd, bytes, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            bytes += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    bool recvAll(void* data, size_t size) {
+        char* bytes = (char*) data;
+        while (size > 0) {
+            const ssize_t n = ::recv(fd, bytes, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            bytes += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+};
+
+/**
+ * Parsed "unix:<path>" or "tcp:<host>:<port>" address.
+ */
+struct Address {
+    bool isLocal = false;
+    std::string path, host, port;
+
+    bool parse(const std::string& s) {
+        if (s.compare(0, 5, "unix:") == 0) {
+            isLocal = true;
+            path = s.substr(5);
+            return !path.empty() && path.size() < sizeof(sockaddr_un::sun_path);
+        }
+        if (s.compare(0, 4, "tcp:") == 0) {
+            const size_t colon = s.rfind(':');
+            if (colon <= 4) return false;
+            host = s.substr(4, colon - 4);
+            port = s.substr(colon + 1);
+            return !port.empty();
+        }
+        return false;
+    }
+
+    sockaddr_un getLocal() const {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+};
+
+static void setNoDelay(int fd, const Address& address) {
+    const int yes = 1;
+    if (!address.isLocal) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+/**
+ * Opens a listening socket, returns -1 on failure.
+ */
+static int listenOn(const Address& address) {
+    if (address.isLocal) {
+        const sockaddr_un addr = address.getLocal();
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(address.path.c_str());
+        if (fd >= 0 && (bind(fd, (const sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* list;
+    const char* host = address.host.empty() || address.host == "*" ? nullptr : address.host.c_str();
+    if (getaddrinfo(host, address.port.c_str(), &hints, &list) != 0) return -1;
+    int fd = -1;
+    for (addrinfo* p = list; p && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        const int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) < 0 || listen(fd, 64) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/**
+ * Connects to a listening socket, returns -1 on failure.
+ */
+static int connectTo(const Address& address) {
+    if (address.isLocal) {
+        const sockaddr_un addr = address.getLocal();
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* list;
+    const char* host = address.host.empty() || address.host == "*" ? "localhost" : address.host.c_str();
+    if (getaddrinfo(host, address.port.c_str(), &hints, &list) != 0) return -1;
+    int fd = -1;
+    for (addrinfo* p = list; p && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd >= 0 && connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if (fd >= 0) setNoDelay(fd, address);
+    return fd;
+}
+
+/**
+ * Starts the local worker processes, they connect back to the coordinator address.
+ */
+static std::vector<pid_t> spawnWorkers(const DistributedOptions& options) {
+    const int threads = options.workerThreads > 0 ? options.workerThreads :
+                        std::max(1, ThreadPool::getThreadCount(0) / std::max(1, options.localWorkers));
+    std::vector<std::string> args = {options.executable};
+    args.insert(args.end(), options.workerArgs.begin(), options.workerArgs.end());
+    args.insert(args.end(), {"--worker", options.address, "--threads", std::to_string(threads)});
+    std::vector<char*> argv;
+    for (std::string& arg : args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    std::vector<pid_t> pids;
+    for (int i = 0; i < options.localWorkers; i++) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        if (pid > 0) pids.push_back(pid);
+    }
+    std::cout << "Started " << pids.size() << " local workers with " << threads << " threads each" << std::endl;
+    return pids;
+}
+
+/**
+ * Copies the samples of a batch of tiles from a worker result into the coordinator buffers.
+ */
+static bool readResult(Renderer& renderer, Message& m, const std::vector<size_t>& tileIDs) {
+    uint32_t n;
+    if (!m.get(n) || n != tileIDs.size()) return false;
+    for (size_t tileID : tileIDs) {
+        const Tile& expected = renderer.tiles[tileID];
+        Tile tile;
+        if (!m.get(tile) || memcmp(&tile, &expected, sizeof(Tile)) != 0) return false;
+        const int width = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            const size_t row = size_t(renderer.accum->width) * (y - renderer.region.y0) + (tile.x0 - renderer.region.x0);
+            if (!m.get(&renderer.accum->data[row], size_t(width)) ||
+                !m.get(&renderer.sampleCounts[row], size_t(width))) return false;
+        }
+    }
+    return true;
+}
+
+bool runCoordinator(Renderer& renderer, const DistributedOptions& options) {
+    Address address;
+    if (!address.parse(options.address)) {
+        std::cerr << "Invalid coordinator address " << options.address << std::endl;
+        return false;
+    }
+    const Config& config = renderer.scene.config;
+    if (config.timeLimit > 0.f || config.noiseThreshold > 0.f)
+        std::cout << "Warning: time limit and adaptive sampling are ignored by the coordinator" << std::endl;
+
+    signal(SIGPIPE, SIG_IGN);
+    const int listener = listenOn(address);
+    if (listener < 0) {
+        std::cerr << "Cannot listen on " << options.address << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::cout << "Coordinator listening on " << options.address << std::endl;
+    std::vector<pid_t> children = spawnWorkers(options);
+
+    struct Worker {
+        Connection connection;
+        int threads = 0;                // Set once the worker is accepted
+        std::vector<size_t> tileIDs;    // Batch being rendered
+        bool failed = false;
+    };
+    std::vector<Worker> workers;
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < renderer.tiles.size(); i++) queue.push_back(i);
+    renderer.accum->clear();
+    std::fill(renderer.sampleCounts.begin(), renderer.sampleCounts.end(), 0);
+
+    const uint64_t configHash = renderer.getConfigHash();
+    const uint64_t sceneHash = renderer.scene.getHash();
+    const auto beginWall = std::chrono::steady_clock::now();
+    size_t done = 0, nextReport = 0;
+    bool ok = true;
+
+    while (done < renderer.tiles.size()) {
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0] = pollfd{listener, POLLIN, 0};
+        for (size_t i = 0; i < workers.size(); i++)
+            fds[i + 1] = pollfd{workers[i].connection.fd, POLLIN, 0};
+        if (poll(fds.data(), fds.size(), 500) < 0 && errno != EINTR) {
+            std::cerr << "Coordinator poll failed: " << strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+
+        // Messages from the workers connected before polling. Only complete messages are handled, so that
+        // a worker stalling mid-message does not hold up the others.
+        for (size_t i = 0; i + 1 < fds.size(); i++) {
+            if (!fds[i + 1].revents) continue;
+            Worker& w = workers[i];
+            const bool open = w.connection.receiveAvailable();
+            Message m;
+            bool invalid = false;
+            while (!w.failed && w.connection.popMessage(m, invalid)) {
+                if (m.type == EHelloMessage && w.threads == 0) {
+                    int32_t threads = 0;
+                    uint64_t workerConfigHash = 0, workerSceneHash = 0;
+                    if (!m.get(threads) || !m.get(workerConfigHash) || !m.get(workerSceneHash) ||
+                        workerConfigHash != configHash || workerSceneHash != sceneHash) {
+                        std::cout << "Rejected a worker with different settings or scene" << std::endl;
+                        Message stop;
+                        stop.type = ETilesMessage;
+                        stop.put(uint32_t(0));
+                        w.connection.send(stop);
+                        w.failed = true;
+                    }
+                    else {
+                        w.threads = std::max(1, int(threads));
+                    }
+                }
+                else if (m.type == EResultMessage && !w.tileIDs.empty() && readResult(renderer, m, w.tileIDs)) {
+                    done += w.tileIDs.size();
+                    w.tileIDs.clear();
+                }
+                else {
+                    w.failed = true;
+                }
+            }
+            if (!open || invalid) w.failed = true;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            Worker w;
+            w.connection.fd = accept(listener, nullptr, nullptr);
+            if (w.connection.fd >= 0) {
+                setNoDelay(w.connection.fd, address);
+                workers.push_back(std::move(w));
+            }
+        }
+
+        // Idle workers get the next batch, one tile per thread
+        for (Worker& w : workers) {
+            if (w.failed || w.threads == 0 || !w.tileIDs.empty() || queue.empty()) continue;
+            Message m;
+            m.type = ETilesMessage;
+            const size_t n = std::min(queue.size(), size_t(w.threads));
+            m.put(uint32_t(n));
+            for (size_t k = 0; k < n; k++) {
+                w.tileIDs.push_back(queue.front());
+                m.put(renderer.tiles[queue.front()]);
+                queue.pop_front();
+            }
+            if (!w.connection.send(m)) w.failed = true;
+        }
+
+        // Tiles of lost workers go back to the front of the queue
+        for (size_t i = workers.size(); i-- > 0;) {
+            Worker& w = workers[i];
+            if (!w.failed) continue;
+            if (!w.tileIDs.empty())
+                std::cout << "Lost a worker, requeuing " << w.tileIDs.size() << " tiles" << std::endl;
+            queue.insert(queue.begin(), w.tileIDs.begin(), w.tileIDs.end());
+            w.connection.close();
+            workers.erase(workers.begin() + std::ptrdiff_t(i));
+        }
+
+        for (size_t i = children.size(); i-- > 0;) {
+            int status;
+            if (waitpid(children[i], &status, WNOHANG) == children[i])
+                children.erase(children.begin() + std::ptrdiff_t(i));
+        }
+        if (options.localWorkers > 0 && children.empty() && workers.empty()) {
+            std::cerr << "All local workers exited before the image was complete" << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (done >= nextReport) {
+            const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - beginWall;
+            std::cout << "Rendered " << done << "/" << renderer.tiles.size() << " tiles with " << workers.size()
+                      << " workers (" << elapsed.count() << "s)" << std::endl;
+            nextReport = done + std::max(size_t(1), renderer.tiles.size() / 10);
+        }
+    }
+
+    // Stop the remaining workers
+    Message stop;
+    stop.type = ETilesMessage;
+    stop.put(uint32_t(0));
+    for (Worker& w : workers) {
+        w.connection.send(stop);
+        w.connection.close();
+    }
+    ::close(listener);
+    if (address.isLocal) unlink(address.path.c_str());
+    for (pid_t pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    if (!ok) return false;
+
+    renderer.samples = 0;
+    for (uint32_t count : renderer.sampleCounts) renderer.samples += count;
+    renderer.pass = 1;
+    renderer.resolve(*renderer.integrator->rgb);
+    renderer.integrator->metadata = renderer.getMetadata();
+    renderer.integrator->channels = renderer.getChannels();
+    const std::chrono::duration<float> wall = std::chrono::steady_clock::now() - beginWall;
+    std::cout << "Rendered " << renderer.tiles.size() << " tiles in " << wall.count() << "s" << std::endl;
+    return true;
+}
+
+bool runWorker(Renderer& renderer, const std::string& addressString) {
+    Address address;
+    if (!address.parse(addressString)) {
+        std::cerr << "Invalid coordinator address " << addressString << std::endl;
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The coordinator may not be listening yet
+    Connection connection;
+    const auto begin = std::chrono::steady_clock::now();
+    while ((connection.fd = connectTo(address)) < 0) {
+        if (std::chrono::steady_clock::now() - begin > std::chrono::seconds(10)) {
+            std::cerr << "Cannot connect to " << addressString << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    Message hello;
+    hello.type = EHelloMessage;
+    hello.put(int32_t(renderer.pool->size()));
+    hello.put(renderer.getConfigHash());
+    hello.put(renderer.scene.getHash());
+    if (!connection.send(hello)) return false;
+
+    renderer.initCamera();
+    renderer.passSpp = std::max(1, renderer.scene.config.spp);
+    const Tile& region = renderer.region;
+    const int bufferWidth = renderer.accum->width;
+    size_t rendered = 0;
+
+    while (true) {
+        Message m;
+        uint32_t n;
+        if (!connection.receive(m) || m.type != ETilesMessage || !m.get(n)) {
+            std::cerr << "Lost connection to the coordinator" << std::endl;
+            connection.close();
+            return false;
+        }
+        if (n == 0) break;
+        renderer.tiles.resize(n);
+        if (!m.get(renderer.tiles.data(), n)) return false;
+
+        for (const Tile& tile : renderer.tiles) {
+            if (tile.x0 < region.x0 || tile.y0 < region.y0 || tile.x1 > region.x1 || tile.y1 > region.y1 ||
+                tile.x1 - tile.x0 > renderer.scene.config.tileSize || tile.y1 - tile.y0 > renderer.scene.config.tileSize) {
+                std::cerr << "Received a tile outside of the image or larger than the tile size" << std::endl;
+                return false;
+            }
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const size_t row = size_t(bufferWidth) * (y - region.y0) + (tile.x0 - region.x0);
+                std::fill(&renderer.accum->data[row], &renderer.accum->data[row] + (tile.x1 - tile.x0), v3f(0.f));
+                std::fill(&renderer.sampleCounts[row], &renderer.sampleCounts[row] + (tile.x1 - tile.x0), 0);
+            }
+        }
+        renderer.pool->parallelFor(n, [&renderer](size_t tileID) { renderer.renderTile(tileID); });
+
+        Message result;
+        result.type = EResultMessage;
+        result.put(n);
+        for (const Tile& tile : renderer.tiles) {
+            result.put(tile);
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const size_t row = size_t(bufferWidth) * (y - region.y0) + (tile.x0 - region.x0);
+                result.put(&renderer.accum->data[row], size_t(tile.x1 - tile.x0));
+                result.put(&renderer.sampleCounts[row], size_t(tile.x1 - tile.x0));
+            }
+        }
+        if (!connection.send(result)) {
+            std::cerr << "Lost connection to the coordinator" << std::endl;
+            connection.close();
+            return false;
+        }
+        rendered += n;
+    }
+
+    connection.close();
+    std::cout << "Worker rendered " << rendered << " tiles" << std::endl;
+    return true;
+}
+
+std::string getDefaultCoordinatorAddress() {
+    return "unix:" + (fs::temp_directory_path() / ("tinyrender-" + std::to_string(getpid()) + ".sock")).string();
+}
+
+#else
+
+bool runCoordinator(Renderer& renderer, const DistributedOptions& options) {
+    std::cerr << "Multi-process rendering is not supported on this platform" << std::endl;
+    return false;
+}
+
+bool runWorker(Renderer& renderer, const std::string& address) {
+    std::cerr << "Multi-process rendering is not supported on this platform" << std::endl;
+    return false;
+}
+
+std::string getDefaultCoordinatorAddress() {
+    return "tcp:localhost:52446";
+}
+
+#endif
+
+TR_NAMESPACE_END
@@ -0,0 +1,48 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <core/platform.h>
+#include <core/renderer.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Multi-process offline rendering.
+ * A coordinator hands out image tiles to worker processes on demand and assembles their results
+ * into one image. Workers load the scene once, render many tiles and may crash without losing work:
+ * their pending tiles go back to the queue. Workers run the same command line as the coordinator
+ * (scene file, crop window) and are checked against its settings and scene on connection.
+ *
+ * Addresses are "unix:<socket path>" or "tcp:<host>:<port>", the coordinator listens on the given
+ * host ("*" for all interfaces). Messages are sent in native byte order.
+ */
+struct DistributedOptions {
+    std::string address;        // Coordinator address
+    int localWorkers = 0;       // Worker processes spawned by the coordinator on this machine
+    int workerThreads = 0;      // Render threads of each spawned worker (0: share the hardware threads)
+    std::string executable;     // Program started for the local workers
+    std::vector<std::string> workerArgs;    // Arguments of the local workers, before the address
+};
+
+/**
+ * Renders the image with the connected workers, the result is left in the integrator buffer.
+ */
+bool runCoordinator(Renderer& renderer, const DistributedOptions& options);
+
+/**
+ * Connects to a coordinator and renders the tiles it sends until told to stop.
+ */
+bool runWorker(Renderer& renderer, const std::string& address);
+
+/**
+ * Address used when spawning local workers without an explicit coordinator address.
+ */
+std::string getDefaultCoordinatorAddress();
+
+TR_NAMESPACE_END
@@ -14,7 +14,8 @@ TR_NAMESPACE_BEGIN
 Integrator::Integrator(const Scene& scene) : scene(scene) { }
 
 bool Integrator::init() {
-    rgb = std::unique_ptr<RenderBuffer>(new RenderBuffer(scene.config.width, scene.config.height));
+    const int* crop = scene.config.crop;
+    rgb = std::unique_ptr<RenderBuffer>(new RenderBuffer(crop[2] - crop[0], crop[3] - crop[1]));
     rgb->clear();
     return true;
 }
@@ -24,11 +25,25 @@ void Integrator::cleanUp() {
 }
 
 bool Integrator::save() {
-    fs::path p = scene.config.tomlFile;
-    saveEXR(rgb->data, p.replace_extension("exr").string(), scene.config.width, scene.config.height);
+    saveEXR(rgb->data, getOutputPath(), rgb->width, rgb->height, metadata, channels);
     return true;
 }
 
+/**
+ * Image path next to the scene file, animation frames are suffixed with their number and cropped renders
+ * with their region.
+ */
+std::string Integrator::getOutputPath() const {
+    fs::path p = scene.config.tomlFile;
+    if (scene.config.frame >= 0)
+        p = p.parent_path() / tfm::format("%s_%04d", p.stem().string(), scene.config.frame);
+    if (scene.config.isCropped) {
+        const int* crop = scene.config.crop;
+        p = p.parent_path() / tfm::format("%s_crop_%d_%d_%d_%d", p.stem().string(), crop[0], crop[1], crop[2], crop[3]);
+    }
+    return p.replace_extension("exr").string();
+}
+
 const Emitter& Integrator::getEmitterByID(const int emitterID) const {
     return scene.emitters[emitterID];
 }
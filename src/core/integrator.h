@@ -17,18 +17,31 @@ struct Scene;
 
 /**
  * Integrator structure.
- * Stores reference to scene, random sampler, main rendering method, etc.
+ * Stores reference to scene, main rendering method, etc.
+ * Random numbers come from the per-sample Sampler stream handed to render().
  */
 struct Integrator {
     const Scene& scene;
-    std::vector<Sampler> samplers;
     std::unique_ptr<RenderBuffer> rgb;
+    std::vector<EXRMetadata> metadata;  // Written in the header of the saved image
+    std::vector<EXRChannel> channels;   // Extra layers of the saved image
+    bool usesPrimaryHits = false;       // Whether renderPrimary() shades the given camera ray hits
 
     explicit Integrator(const Scene& scene);
     virtual bool init();
     virtual void cleanUp();
     virtual v3f render(const Ray&, Sampler&) const = 0;
+
+    /**
+     * Shades a camera ray whose closest hit was found beforehand by a packet query (found is false if
+     * the ray escaped). Integrators starting with that query override it and set usesPrimaryHits,
+     * by default the ray is traced again.
+     */
+    virtual v3f renderPrimary(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit, bool found) const {
+        return render(ray, sampler);
+    }
     bool save();
+    std::string getOutputPath() const;
 
     /**
      * Helper functions for emitter getters.
@@ -58,20 +58,42 @@ inline float getLuminance(const v3f& rgb) {
 }
 
 /**
- * Pseudo-random sampler (Mersenne Twister 19937) structure.
+ * Counter-based pseudo-random sampler.
+ * The n-th number of a stream is a hash of (seed, stream, n): streams are decorrelated,
+ * and any of them can be started or replayed without generating the preceding numbers.
  */
 struct Sampler {
-    std::mt19937 g;
-    std::uniform_real_distribution<float> d;
-    explicit Sampler(int seed) {
-        g = std::mt19937(seed);
-        d = std::uniform_real_distribution<float>(0.f, 1.f);
+    uint64_t key;       // Hashed seed and stream index
+    uint64_t counter;   // Position in the stream
+
+    explicit Sampler(int seed) { setSeed(seed); }
+    Sampler(uint64_t seed, uint64_t stream) { setStream(seed, stream); }
+
+    float next() {
+        // Keep the 24 most significant bits, exactly representable in [0, 1)
+        return float(hash(key + (counter++) * 0x9e3779b97f4a7c15ull) >> 40) * (1.f / 16777216.f);
+    }
+    p2f next2D() { return {next(), next()}; }
+    void setSeed(int seed) { setStream(uint64_t(seed), 0); }
+    void setStream(uint64_t seed, uint64_t stream) {
+        key = hash(hash(seed) ^ stream);
+        counter = 0;
     }
-    float next() { return d(g); }
-    p2f next2D() { return {d(g), d(g)}; }
-    void setSeed(int seed) {
-        g.seed(seed);
-        d.reset();
+
+    /**
+     * Stream of the given sample of a pixel, so every sample can be regenerated on its own.
+     */
+    static uint64_t pixelStream(size_t pixelID, uint32_t sampleID) {
+        return (uint64_t(pixelID) << 32) | sampleID;
+    }
+
+    /**
+     * 64-bit finalizer of SplitMix64.
+     */
+    static uint64_t hash(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
     }
 };
 
@@ -0,0 +1,275 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <core/platform.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Work-stealing thread pool.
+ * Every worker owns a task deque: it pops from the front of its own deque and,
+ * once empty, steals from the back of the other workers' deques.
+ * The thread waiting on a task group helps executing tasks, so groups can be nested.
+ */
+struct ThreadPool {
+    typedef std::function<void()> Task;
+
+    /**
+     * Set of tasks that can be waited on.
+     */
+    struct TaskGroup {
+        std::atomic<int> pending{0};
+    };
+
+    explicit ThreadPool(int nThreads) {
+        nThreads = std::max(1, nThreads);
+        queues = std::vector<Queue>(size_t(nThreads));
+        // The calling thread takes the last slot, it only runs tasks while waiting
+        for (int i = 0; i < nThreads - 1; i++)
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stop = true;
+        }
+        sleepCv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    /**
+     * Number of threads executing tasks (workers and waiting thread).
+     */
+    int size() const { return int(queues.size()); }
+
+    /**
+     * Index of the calling thread in [0, size()), used to address per-thread data.
+     */
+    int threadID() const { return currentPool() == this ? currentID() : size() - 1; }
+
+    /**
+     * Returns the number of hardware threads, or the requested count if positive.
+     */
+    static int getThreadCount(int requested) {
+        if (requested > 0) return requested;
+        return std::max(1, int(std::thread::hardware_concurrency()));
+    }
+
+    /**
+     * Enqueues a task on the deque of the calling thread (or of a given worker).
+     */
+    void run(TaskGroup& group, Task task, int queueID = -1) {
+        group.pending++;
+        Task wrapped = [&group, task]() {
+            task();
+            group.pending--;
+        };
+        Queue& q = queues[queueID >= 0 ? queueID : threadID()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_front(std::move(wrapped));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            queued++;
+        }
+        sleepCv.notify_one();
+    }
+
+    /**
+     * Blocks until every task of the group is done, executing pending tasks meanwhile.
+     */
+    void wait(TaskGroup& group) {
+        const int id = threadID();
+        while (group.pending > 0) {
+            if (!runOne(id))
+                std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Calls f(i) for i in [0, count) in parallel.
+     * Indices are dealt in contiguous blocks to the workers, idle workers steal the remainder.
+     */
+    void parallelFor(size_t count, const std::function<void(size_t)>& f) {
+        TaskGroup group;
+        const size_t n = queues.size();
+        for (size_t i = count; i-- > 0;)
+            run(group, [&f, i]() { f(i); }, int(i * n / count));
+        wait(group);
+    }
+
+  private:
+    struct Queue {
+        std::deque<Task> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queued{0};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCv;
+    bool stop = false;
+
+    static const ThreadPool*& currentPool() {
+        static thread_local const ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static int& currentID() {
+        static thread_local int id = 0;
+        return id;
+    }
+
+    bool pop(int id, Task& task) {
+        Queue& q = queues[id];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+    }
+
+    bool steal(int id, Task& task) {
+        const int n = size();
+        for (int k = 1; k < n; k++) {
+            Queue& q = queues[(id + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tasks.empty()) continue;
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    bool runOne(int id) {
+        Task task;
+        if (!pop(id, task) && !steal(id, task)) return false;
+        queued--;
+        task();
+        return true;
+    }
+
+    void workerLoop(int id) {
+        currentPool() = this;
+        currentID() = id;
+        while (true) {
+            if (runOne(id)) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCv.wait(lock, [this]() { return stop || queued > 0; });
+            if (stop) return;
+        }
+    }
+};
+
+/**
+ * Sorts values by their keys, of which only the low bits are set (stable least significant digit
+ * radix sort). Large arrays are counted and scattered in parallel chunks on the thread pool if given:
+ * every chunk writes each digit after the same digit of the previous chunks.
+ */
+inline void radixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, ThreadPool* pool = nullptr,
+                      int bits = 32) {
+    const size_t n = keys.size();
+    const size_t nChunks = pool && n >= 65536 ? std::min(size_t(pool->size()) * 4, n / 16384) : 1;
+    std::vector<uint32_t> sortedKeys(n), sortedValues(n);
+    std::vector<size_t> offsets(nChunks * 256);
+    auto forChunks = [pool, nChunks, n](const std::function<void(size_t, size_t, size_t)>& f) {
+        if (nChunks == 1) f(0, 0, n);
+        else pool->parallelFor(nChunks, [&](size_t c) { f(c, n * c / nChunks, n * (c + 1) / nChunks); });
+    };
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), size_t(0));
+        forChunks([&](size_t c, size_t begin, size_t end) {
+            size_t* count = &offsets[c * 256];
+            for (size_t i = begin; i < end; i++) count[(keys[i] >> shift) & 255]++;
+        });
+        size_t sum = 0;
+        for (size_t d = 0; d < 256; d++)
+            for (size_t c = 0; c < nChunks; c++) {
+                const size_t count = offsets[c * 256 + d];
+                offsets[c * 256 + d] = sum;
+                sum += count;
+            }
+        forChunks([&](size_t c, size_t begin, size_t end) {
+            size_t* next = &offsets[c * 256];
+            for (size_t i = begin; i < end; i++) {
+                const size_t j = next[(keys[i] >> shift) & 255]++;
+                sortedKeys[j] = keys[i];
+                sortedValues[j] = values[i];
+            }
+        });
+        keys.swap(sortedKeys);
+        values.swap(sortedValues);
+    }
+}
+
+/**
+ * Background I/O thread.
+ * Holds at most one pending job: a job submitted while another one is waiting replaces it,
+ * so the render loop never blocks on disk writes and only the latest state gets written.
+ */
+struct BackgroundWriter {
+    typedef std::function<void()> Job;
+
+    BackgroundWriter() : thread(&BackgroundWriter::loop, this) { }
+
+    ~BackgroundWriter() { finish(); }
+
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = std::move(job);
+        }
+        cv.notify_one();
+    }
+
+    /**
+     * Runs the pending job, if any, then stops the thread.
+     */
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+  private:
+    Job pending;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+
+    void loop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stop || pending; });
+                if (!pending) return;
+                std::swap(job, pending);
+            }
+            job();
+        }
+    }
+};
+
+TR_NAMESPACE_END
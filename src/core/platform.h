@@ -27,6 +27,7 @@ using namespace std;
 #if defined(_WIN32)
 #include <experimental/filesystem>
 namespace fs = experimental::filesystem;
+typedef std::error_code fs_error_code;
 using I = int;
 // Reverses byte order
 inline I bswap(I x) { return _byteswap_ulong(x); }
@@ -34,9 +35,11 @@ inline I bswap(I x) { return _byteswap_ulong(x); }
 #if defined(__APPLE__)
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
+typedef boost::system::error_code fs_error_code;
 #elif defined(__GNUC__)
 #include <experimental/filesystem>
 namespace fs = experimental::filesystem;
+typedef std::error_code fs_error_code;
 #endif
 inline int bswap(int x) { return __builtin_bswap32(x); }
 inline string pp(string p) {
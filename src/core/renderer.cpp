@@ -9,6 +9,8 @@
 #include <core/accel.h>
 #include <core/renderer.h>
 #include <GL/glew.h>
+#include <chrono>
+#include <fstream>
 
 #ifdef __APPLE__
 #include "SDL.h"
@@ -45,7 +47,60 @@
 
 TR_NAMESPACE_BEGIN
 
-Renderer::Renderer(const Config& config) : scene(config) { }
+/**
+ * Converts a distance along the Hilbert curve filling a n x n grid (n power of two) to grid coordinates.
+ */
+static glm::ivec2 hilbertToXY(int n, int d) {
+    glm::ivec2 p(0);
+    for (int s = 1; s < n; s *= 2) {
+        const int rx = 1 & (d / 2);
+        const int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) p = glm::ivec2(s - 1) - p;
+            std::swap(p.x, p.y);
+        }
+        p += glm::ivec2(s * rx, s * ry);
+        d /= 4;
+    }
+    return p;
+}
+
+/**
+ * Converts a Morton (Z-order) code to 2D coordinates by de-interleaving its bits.
+ */
+static glm::ivec2 mortonToXY(uint32_t d) {
+    glm::ivec2 p(0);
+    for (int bit = 0; bit < 16; bit++) {
+        p.x |= int((d >> (2 * bit)) & 1) << bit;
+        p.y |= int((d >> (2 * bit + 1)) & 1) << bit;
+    }
+    return p;
+}
+
+/**
+ * Pixel offsets of a square tile in traversal order.
+ * Space-filling curves cover the next power-of-two square, offsets outside the tile are dropped.
+ */
+static std::vector<glm::ivec2> getPixelOrder(ETileOrder order, int tileSize) {
+    std::vector<glm::ivec2> offsets;
+    offsets.reserve(size_t(tileSize) * tileSize);
+    if (order == EScanlineOrder) {
+        for (int y = 0; y < tileSize; y++)
+            for (int x = 0; x < tileSize; x++)
+                offsets.emplace_back(x, y);
+        return offsets;
+    }
+
+    int n = 1;
+    while (n < tileSize) n *= 2;
+    for (int d = 0; d < n * n; d++) {
+        const glm::ivec2 p = order == EMortonOrder ? mortonToXY(uint32_t(d)) : hilbertToXY(n, d);
+        if (p.x < tileSize && p.y < tileSize) offsets.push_back(p);
+    }
+    return offsets;
+}
+
+Renderer::Renderer(const Config& config, std::shared_ptr<SceneGeometry> geometry) : scene(config, geometry) { }
 
 bool Renderer::init(const bool isRealTime, bool nogui) {
     realTime = isRealTime;
@@ -97,10 +152,33 @@ bool Renderer::init(const bool isRealTime, bool nogui) {
             throw std::runtime_error("Invalid integrator type");
         }
 
+        // Split the image plane into tiles, scheduled over the worker threads
+        pool = std::unique_ptr<ThreadPool>(new ThreadPool(ThreadPool::getThreadCount(scene.config.threads)));
+        const int tileSize = std::max(1, scene.config.tileSize);
+        tiles.clear();
+        const int* crop = scene.config.crop;
+        region = Tile{crop[0], crop[1], crop[2], crop[3]};
+        for (int y = region.y0; y < region.y1; y += tileSize)
+            for (int x = region.x0; x < region.x1; x += tileSize)
+                tiles.push_back(Tile{x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1)});
+        pixelOrder = getPixelOrder(scene.config.tileOrder, tileSize);
+
+        const int regionWidth = region.x1 - region.x0, regionHeight = region.y1 - region.y0;
+        accum = std::unique_ptr<RenderBuffer>(new RenderBuffer(regionWidth, regionHeight));
+        sampleCounts.assign(size_t(regionWidth) * regionHeight, 0);
+        active.assign(sampleCounts.size(), 1);
+        if (scene.config.noiseThreshold > 0.f)
+            accumHalf = std::unique_ptr<RenderBuffer>(new RenderBuffer(regionWidth, regionHeight));
+        writer = std::unique_ptr<BackgroundWriter>(new BackgroundWriter());
+        if (!scene.config.bvhStatsFile.empty()) writeBVHStats(false);
+
         return integrator->init();
     }
 }
 
+// Seconds between checkpoints of a render saving its state, when none are configured
+static const float stateInterval = 300.f;
+
 void Renderer::render() {
     if (realTime) {
         /**
@@ -128,57 +206,703 @@ void Renderer::render() {
         /**
          * 1) Calculate the camera perspective, the camera-to-world transformation matrix and the aspect ratio.
          * 2) Clear integral RGB buffer.
-         * 3) Loop over all pixels on the image plane.
-         * 4) Generate a ray through each pixel center.
-         * 5) Splat their contribution onto the image plane.
+         * 3) Dispatch the image tiles to the thread pool.
+         * 4) Generate rays through each pixel of a tile and splat their contribution onto the image plane.
          */
-        v3f EYE = scene.config.camera.o;
-        v3f AT = scene.config.camera.at;
-        v3f UP = scene.config.camera.up;
-        float fov = scene.config.camera.fov;
-
-        mat4f inverseView = glm::lookAt(EYE, AT, UP);
-        float aspectRatio = (float) scene.config.width / (float) scene.config.height;
-        float scale = tan(deg2rad*(fov * 0.5));
+        initCamera();
 
-        //Clear rgb buffer and instantiate sampler
         integrator->rgb->clear();
-        Sampler sampler = Sampler(260631195);
-        Sampler sampler2 = Sampler(123);
+        accum->clear();
+        std::fill(sampleCounts.begin(), sampleCounts.end(), 0);
+        if (accumHalf) accumHalf->clear();
+        std::fill(active.begin(), active.end(), 1);
+        samples = 0;
+        pass = 0;
+        if (scene.config.resume && saveFiles) resume();
+        BVHStats::reset();
+
+        // Progressive rendering: add passes of passSpp samples, with periodic EXR checkpoints.
+        // With a time limit, passes are added until the deadline and spp (if positive) is an upper bound.
+        // With adaptive sampling, converged pixels drop out and their budget goes to the noisy ones.
+        // A saved render state is written during the render: without a pass size or checkpoints of their own,
+        // passes take one sample and a checkpoint is written every stateInterval seconds.
+        const bool timed = scene.config.timeLimit > 0.f;
+        const bool adaptive = scene.config.noiseThreshold > 0.f;
+        const bool saving = scene.config.saveState && saveFiles;
+        const bool checkpoints = scene.config.checkpointPasses > 0 || scene.config.checkpointInterval > 0.f;
+        const float checkpointInterval = saving && !checkpoints ? stateInterval : scene.config.checkpointInterval;
+        const size_t nPixels = sampleCounts.size();
+        const uint64_t budget = scene.config.spp > 0 ? uint64_t(scene.config.spp) * nPixels :
+                                (timed ? std::numeric_limits<uint64_t>::max() : nPixels);
+        const int defaultPassSpp = adaptive ? 4 : (timed || saving ? 1 : std::numeric_limits<int>::max());
+        const int maxPassSpp = scene.config.passSpp > 0 ? scene.config.passSpp : defaultPassSpp;
+
+        const clock_t beginRender = clock();
+        const auto beginWall = std::chrono::steady_clock::now();
+        auto lastCheckpoint = beginWall;
+        size_t nActive = size_t(std::count(active.begin(), active.end(), 1));
+
+        while (nActive > 0 && samples < budget) {
+            passSpp = int(std::min(uint64_t(maxPassSpp), std::max(uint64_t(1), (budget - samples) / nActive)));
+            pool->parallelFor(tiles.size(), [this](size_t tileID) { renderTile(tileID); });
+            samples += uint64_t(passSpp) * nActive;
+            pass++;
+
+            // The pass running when the deadline expires is always completed
+            const auto now = std::chrono::steady_clock::now();
+            const std::chrono::duration<float> elapsed = now - beginWall;
+            const std::chrono::duration<float> sinceCheckpoint = now - lastCheckpoint;
+            if (samples >= budget || (timed && elapsed.count() >= scene.config.timeLimit)) break;
+            if (adaptive) nActive = updateConvergence();
+
+            std::cout << "Pass " << pass << ": " << float(samples) / nPixels << " spp, " << nActive << " active pixels ("
+                      << elapsed.count() << "s)" << std::endl;
+            if (saveFiles && ((scene.config.checkpointPasses > 0 && pass % scene.config.checkpointPasses == 0) ||
+                (checkpointInterval > 0.f && sinceCheckpoint.count() >= checkpointInterval))) {
+                checkpoint();
+                lastCheckpoint = now;
+            }
+        }
+        resolve(*integrator->rgb);
+        integrator->metadata = getMetadata();
+        integrator->channels = getChannels();
+
+        if (saving) {
+            std::shared_ptr<RenderState> state(new RenderState(getState()));
+            const std::string path = getStatePath();
+            writer->submit([state, path]() { state->save(path); });
+        }
+
+        const std::chrono::duration<float> wall = std::chrono::steady_clock::now() - beginWall;
+        std::cout << "Rendered " << tiles.size() << " tiles on " << pool->size() << " threads in "
+                  << wall.count() << "s (" << float(clock() - beginRender) / CLOCKS_PER_SEC << "s CPU)" << std::endl;
+        if (!scene.config.bvhStatsFile.empty() && saveFiles) {
+            writeBVHStats(true);
+            if (!BVHStats::enabled)
+                std::cout << "Traversal statistics need a build with the TINYRENDER_BVH_STATS option" << std::endl;
+        }
+    }
+}
+
+/**
+ * Calculates the camera perspective, the camera-to-world transformation matrix and the aspect ratio.
+ */
+void Renderer::initCamera() {
+    v3f EYE = scene.config.camera.o;
+    v3f AT = scene.config.camera.at;
+    v3f UP = scene.config.camera.up;
+    float fov = scene.config.camera.fov;
+
+    inverseView = glm::lookAt(EYE, AT, UP);
+    aspectRatio = (float) scene.config.width / (float) scene.config.height;
+    scale = tan(deg2rad*(fov * 0.5));
+}
+
+/**
+ * Generates a camera ray through film position (x, y), in pixel units.
+ */
+Ray Renderer::generateRay(float x, float y) const {
+    float pixelNDCX = x / (float) scene.config.width;   //[0, 1]
+    float pixelNDCY = y / (float) scene.config.height;  //[0, 1]
+    float pixelScreenX = 2 * pixelNDCX - 1;     //[-1, 1]
+    float pixelScreenY = 1 - 2 * pixelNDCY;     //[-1, 1]
+    float pixelCameraX = (pixelScreenX) * aspectRatio * scale; //[-aspectRatio*scale, aspectRatio*scale]
+    float pixelCameraY = (pixelScreenY) * scale;    //[-scale, scale]
+    v3f dir = v3f(pixelCameraX, pixelCameraY, -1.f);
+    v4f direction = glm::normalize(v4f(dir, 0.f) * inverseView);
+    return Ray(scene.config.camera.o, direction);
+}
+
+/**
+ * Adds passSpp samples to all active pixels of a tile, following the tile traversal order.
+ * Each sample of each pixel draws from its own sampler stream, so the image is the same
+ * whatever the thread count, the order in which tiles or pixels are rendered, the pass size
+ * or the crop window. Buffers only cover the rendered region.
+ */
+void Renderer::renderTile(size_t tileID) {
+    const Tile& tile = tiles[tileID];
+
+    // Camera rays of consecutive samples are traced as packets when the integrator shades their hits
+    const int packetSize = integrator->usesPrimaryHits ? AcceleratorBVH::PacketSize : 1;
+    std::vector<Ray> rays;
+    std::vector<Sampler> samplers;
+    std::vector<size_t> bufferIDs;
+    std::vector<uint32_t> sampleIDs;
+    SurfaceInteraction hits[AcceleratorBVH::PacketSize];
+    bool found[AcceleratorBVH::PacketSize];
+    auto flush = [&]() {
+        const int n = int(rays.size());
+        if (packetSize > 1) {
+            std::fill(hits, hits + n, SurfaceInteraction());
+            scene.bvh->intersect(rays.data(), n, hits, found);
+        }
+        for (int k = 0; k < n; k++) {
+            const v3f color = packetSize > 1 ? integrator->renderPrimary(rays[k], samplers[k], hits[k], found[k])
+                                             : integrator->render(rays[k], samplers[k]);
+            accum->data[bufferIDs[k]] += color;
+            if (accumHalf && (sampleIDs[k] & 1)) accumHalf->data[bufferIDs[k]] += color;
+        }
+        rays.clear();
+        samplers.clear();
+        bufferIDs.clear();
+        sampleIDs.clear();
+    };
+
+    for (const glm::ivec2& offset : pixelOrder) {
+        const int pixelX = tile.x0 + offset.x;
+        const int pixelY = tile.y0 + offset.y;
+        if (pixelX >= tile.x1 || pixelY >= tile.y1) continue;
+
+        const size_t pixelID = size_t(scene.config.width) * pixelY + pixelX;
+        const size_t bufferID = size_t(accum->width) * (pixelY - region.y0) + (pixelX - region.x0);
+        if (!active[bufferID]) continue;
+
+        const uint32_t first = sampleCounts[bufferID];
+        for (uint32_t i = first; i < first + passSpp; i++) {  //anti-aliasing component - implementation of A1 bonus
+            Sampler sampler(uint64_t(scene.config.seed), Sampler::pixelStream(pixelID, i));
+            const p2f jitter = sampler.next2D();
+            rays.push_back(generateRay(pixelX + jitter.x, pixelY + jitter.y));
+            samplers.push_back(sampler);
+            bufferIDs.push_back(bufferID);
+            sampleIDs.push_back(i);
+            if (int(rays.size()) == packetSize) flush();
+        }
+        sampleCounts[bufferID] = first + passSpp;
+    }
+    flush();
+}
+
+/**
+ * Deactivates pixels whose noise estimate fell below the threshold, returns the number of active pixels.
+ * The estimate compares the means of the even and odd samples, relative to the square root of the pixel mean.
+ */
+size_t Renderer::updateConvergence() {
+    size_t nActive = 0;
+    for (size_t i = 0; i < sampleCounts.size(); i++) {
+        const uint32_t n = sampleCounts[i];
+        if (active[i] && n >= uint32_t(std::max(2, scene.config.minSpp))) {
+            const v3f odd = accumHalf->data[i] / float(n / 2);
+            const v3f even = (accum->data[i] - accumHalf->data[i]) / float(n - n / 2);
+            const v3f mean = accum->data[i] / float(n);
+            const v3f diff = glm::abs(even - odd);
+            const float error = (diff.x + diff.y + diff.z) / std::sqrt(std::max(mean.x + mean.y + mean.z, 1e-4f));
+            active[i] = error >= scene.config.noiseThreshold;
+        }
+        nActive += active[i];
+    }
+    return nActive;
+}
+
+/**
+ * Averages the accumulated samples into an image.
+ */
+void Renderer::resolve(RenderBuffer& image) const {
+    for (size_t i = 0; i < sampleCounts.size(); i++)
+        image.data[i] = sampleCounts[i] > 0 ? accum->data[i] / (float) sampleCounts[i] : v3f(0.f);
+}
+
+/**
+ * Extra image layers: number of samples taken in each pixel, if requested.
+ */
+std::vector<EXRChannel> Renderer::getChannels() const {
+    if (!scene.config.sampleCountLayer) return {};
+    EXRChannel counts{"sampleCount", std::vector<float>(sampleCounts.begin(), sampleCounts.end())};
+    return {counts};
+}
+
+/**
+ * Header attributes describing the accumulated samples: achieved samples per pixel and,
+ * for cropped renders, the region (inclusive box) and full image size to merge them back.
+ */
+std::vector<EXRMetadata> Renderer::getMetadata() const {
+    uint64_t total = 0;
+    for (uint32_t count : sampleCounts) total += count;
+    const int spp = sampleCounts.empty() ? 0 : int(total / sampleCounts.size());
+    std::vector<EXRMetadata> metadata = {EXRMetadata{"spp", "int", {spp}}};
+    if (scene.config.isCropped) {
+        metadata.push_back(EXRMetadata{"cropWindow", "box2i", {region.x0, region.y0, region.x1 - 1, region.y1 - 1}});
+        metadata.push_back(EXRMetadata{"fullSize", "v2i", {scene.config.width, scene.config.height}});
+    }
+    return metadata;
+}
+
+/**
+ * Writes the current estimate of the image (and the render state, if enabled) from the background thread.
+ * Files are written to a temporary path first, then renamed over the previous checkpoint.
+ */
+void Renderer::checkpoint() {
+    std::shared_ptr<RenderBuffer> image(new RenderBuffer(accum->width, accum->height));
+    resolve(*image);
+
+    std::shared_ptr<RenderState> state;
+    if (scene.config.saveState) state = std::shared_ptr<RenderState>(new RenderState(getState()));
+
+    const std::string path = integrator->getOutputPath();
+    const std::string statePath = getStatePath();
+    const std::vector<EXRMetadata> metadata = getMetadata();
+    const std::vector<EXRChannel> channels = getChannels();
+    writer->submit([image, state, path, statePath, metadata, channels]() {
+        // A failed checkpoint is reported and the render goes on
+        const std::string tmp = path + ".tmp.exr";
+        if (saveEXR(image->data, tmp, image->width, image->height, metadata, channels)) {
+            fs_error_code error;
+            fs::rename(tmp, path, error);
+            if (error) std::cout << "Could not write the checkpoint " << path << ": " << error.message() << std::endl;
+        }
+        std::remove(tmp.c_str());
+        if (state) state->save(statePath);
+    });
+}
+
+/**
+ * Fingerprint of the settings that change pixel values (but not of the sample budget or scheduling).
+ */
+uint64_t Renderer::getConfigHash() const {
+    const Config& c = scene.config;
+    Hasher h;
+    h.add(c.width);
+    h.add(c.height);
+    h.add(c.seed);
+    h.add(c.crop);
+    h.add(c.camera);
+    h.add(c.frame);
+    h.add(c.integrator);
+    if (c.integrator == EROIntegrator) {
+        h.add(c.integratorSettings.ro);
+    }
+    else if (c.integrator == EDirectIntegrator) {
+        h.add(c.integratorSettings.di.emitterSamples);
+        h.add(c.integratorSettings.di.bsdfSamples);
+        h.add(c.integratorSettings.di.samplingStrategy);
+    }
+    else if (c.integrator == EPathTracerIntegrator) {
+        h.add(c.integratorSettings.pt.isExplicit);
+        h.add(c.integratorSettings.pt.maxDepth);
+        h.add(c.integratorSettings.pt.rrDepth);
+        h.add(c.integratorSettings.pt.rrProb);
+    }
+    return h.value;
+}
+
+std::string Renderer::getStatePath() const {
+    fs::path p = integrator->getOutputPath();
+    return p.replace_extension("state").string();
+}
+
+/**
+ * BVH report path, suffixed with the frame number during an animation like the images.
+ */
+std::string Renderer::getBVHStatsPath() const {
+    fs::path p = scene.config.bvhStatsFile;
+    if (scene.config.frame < 0) return p.string();
+    return (p.parent_path() / tfm::format("%s_%04d%s", p.stem().string(), scene.config.frame,
+                                          p.extension().string())).string();
+}
+
+RenderState Renderer::getState() const {
+    const size_t n = sampleCounts.size();
+    RenderState state;
+    state.configHash = getConfigHash();
+    state.sceneHash = scene.getHash();
+    state.width = accum->width;
+    state.height = accum->height;
+    state.pass = pass;
+    state.samples = samples;
+    state.accum.assign(accum->data.get(), accum->data.get() + n);
+    if (accumHalf) state.accumHalf.assign(accumHalf->data.get(), accumHalf->data.get() + n);
+    state.sampleCounts = sampleCounts;
+    state.active = active;
+    return state;
+}
+
+/**
+ * Restores the accumulated samples from the saved render state.
+ * A missing or mismatching state file is reported and the render starts from scratch.
+ */
+bool Renderer::resume() {
+    RenderState state;
+    const std::string path = getStatePath();
+    if (!state.load(path)) {
+        std::cout << "No render state to resume from at " << path << std::endl;
+        return false;
+    }
+    if (state.configHash != getConfigHash() || state.sceneHash != scene.getHash() ||
+        state.width != accum->width || state.height != accum->height ||
+        state.accumHalf.empty() != !accumHalf) {
+        std::cout << "Render state " << path << " does not match the scene or settings, starting over" << std::endl;
+        return false;
+    }
+
+    std::copy(state.accum.begin(), state.accum.end(), accum->data.get());
+    if (accumHalf) std::copy(state.accumHalf.begin(), state.accumHalf.end(), accumHalf->data.get());
+    sampleCounts = state.sampleCounts;
+    active = state.active;
+    samples = state.samples;
+    pass = state.pass;
+    std::cout << "Resumed from " << path << " after " << pass << " passes ("
+              << float(samples) / sampleCounts.size() << " spp)" << std::endl;
+    return true;
+}
+
+/**
+ * Render state file: magic, version, header fields, then the raw per-pixel arrays.
+ */
+static const char renderStateMagic[8] = {'T', 'R', 'S', 'T', 'A', 'T', 'E', '\0'};
+static const uint32_t renderStateVersion = 1;
+
+bool RenderState::save(const std::string& path) const {
+    const std::string tmp = path + ".tmp";
+    bool written;
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        auto write = [&out](const void* data, size_t size) { out.write((const char*) data, std::streamsize(size)); };
+        const uint64_t n = sampleCounts.size();
+        const uint8_t hasHalf = !accumHalf.empty();
+        write(renderStateMagic, sizeof(renderStateMagic));
+        write(&renderStateVersion, sizeof(renderStateVersion));
+        write(&configHash, sizeof(configHash));
+        write(&sceneHash, sizeof(sceneHash));
+        write(&width, sizeof(width));
+        write(&height, sizeof(height));
+        write(&pass, sizeof(pass));
+        write(&samples, sizeof(samples));
+        write(&n, sizeof(n));
+        write(&hasHalf, sizeof(hasHalf));
+        write(accum.data(), sizeof(v3f) * n);
+        if (hasHalf) write(accumHalf.data(), sizeof(v3f) * n);
+        write(sampleCounts.data(), sizeof(uint32_t) * n);
+        write(active.data(), sizeof(uint8_t) * n);
+        out.close();
+        written = bool(out);
+    }
+    // Runs on the background writer: failures are reported, never thrown
+    fs_error_code error;
+    if (written) fs::rename(tmp, path, error);
+    if (!written || error) {
+        std::cout << "Could not write the render state " << path;
+        if (error) std::cout << ": " << error.message();
+        std::cout << std::endl;
+        std::remove(tmp.c_str());
+        return false;
+    }
+    std::cout << "Saved render state to " << path << std::endl;
+    return true;
+}
+
+bool RenderState::load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    auto read = [&in](void* data, size_t size) { in.read((char*) data, std::streamsize(size)); };
+    char magic[8];
+    uint32_t version;
+    uint64_t n;
+    uint8_t hasHalf;
+    read(magic, sizeof(magic));
+    read(&version, sizeof(version));
+    if (!in || !std::equal(magic, magic + 8, renderStateMagic) || version != renderStateVersion) return false;
+    read(&configHash, sizeof(configHash));
+    read(&sceneHash, sizeof(sceneHash));
+    read(&width, sizeof(width));
+    read(&height, sizeof(height));
+    read(&pass, sizeof(pass));
+    read(&samples, sizeof(samples));
+    read(&n, sizeof(n));
+    read(&hasHalf, sizeof(hasHalf));
+    if (!in || n != uint64_t(width) * uint64_t(height)) return false;
+    accum.resize(n);
+    accumHalf.resize(hasHalf ? n : 0);
+    sampleCounts.resize(n);
+    active.resize(n);
+    read(accum.data(), sizeof(v3f) * n);
+    if (hasHalf) read(accumHalf.data(), sizeof(v3f) * n);
+    read(sampleCounts.data(), sizeof(uint32_t) * n);
+    read(active.data(), sizeof(uint8_t) * n);
+    return bool(in);
+}
+
+
+/**
+ * Renders the scene with every tile traversal order and reports the speedup over scanline order.
+ * After a warm-up render, the orders take turns and each keeps its best time of a few runs.
+ * No image, checkpoint or render state is saved.
+ */
+void Renderer::benchmarkTileOrders() {
+    const char* names[ETileOrders] = {"scanline", "morton", "hilbert"};
+    float times[ETileOrders];
+    std::fill(times, times + ETileOrders, std::numeric_limits<float>::max());
+    saveFiles = false;
+    render();
+    for (int run = 0; run < 3; run++) {
+        for (int order = 0; order < ETileOrders; order++) {
+            pixelOrder = getPixelOrder(ETileOrder(order), std::max(1, scene.config.tileSize));
+            const auto begin = std::chrono::steady_clock::now();
+            render();
+            const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+            times[order] = std::min(times[order], elapsed.count());
+        }
+    }
+    saveFiles = true;
+
+    std::cout << "\nTile order benchmark (" << tiles.size() << " tiles of " << scene.config.tileSize << "px, "
+              << pool->size() << " threads)" << std::endl;
+    for (int order = 0; order < ETileOrders; order++)
+        std::cout << "  " << std::setw(8) << names[order] << ": " << times[order] << "s, speedup x"
+                  << times[EScanlineOrder] / times[order] << std::endl;
+}
+
+/**
+ * Benchmark rays: a primary ray through the center of every pixel of the rendered region, then a diffuse
+ * bounce from each primary hit.
+ */
+std::vector<Ray> Renderer::getBenchmarkRays(size_t& nPrimary) {
+    initCamera();
+    std::vector<Ray> rays;
+    for (int y = region.y0; y < region.y1; y++)
+        for (int x = region.x0; x < region.x1; x++)
+            rays.push_back(generateRay(x + .5f, y + .5f));
+    nPrimary = rays.size();
+    for (size_t i = 0; i < nPrimary; i++) {
+        SurfaceInteraction hit;
+        if (!scene.bvh->intersect(rays[i], hit)) continue;
+        Sampler sampler(uint64_t(scene.config.seed), Sampler::pixelStream(i, 0));
+        rays.push_back(Ray(hit.p, hit.frameNs.toWorld(Warp::squareToCosineHemisphere(sampler.next2D()))));
+    }
+    return rays;
+}
+
+/**
+ * Traces the first count benchmark rays in chunks over the thread pool and returns the best time of a few
+ * runs. query(begin, end) traces rays [begin, end) and returns the number of hits.
+ */
+float Renderer::traceBenchmark(size_t count, const std::function<size_t(size_t, size_t)>& query, size_t& hits) {
+    const size_t chunkSize = 4096;
+    const size_t nChunks = (count + chunkSize - 1) / chunkSize;
+    std::vector<size_t> chunkHits(nChunks, 0);
+    float best = std::numeric_limits<float>::max();
+    for (int run = 0; run < 3; run++) {
+        const auto begin = std::chrono::steady_clock::now();
+        pool->parallelFor(nChunks, [&](size_t chunk) {
+            chunkHits[chunk] = query(chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+        });
+        const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+        best = std::min(best, elapsed.count());
+    }
+    hits = 0;
+    for (size_t n : chunkHits) hits += n;
+    return best;
+}
 
+/**
+ * Builds the BVH with every builder and traces the same rays through each of them:
+ * one primary ray per pixel center and one cosine-distributed bounce ray per primary hit.
+ */
+void Renderer::benchmarkAccelerators() {
+    size_t nPrimary;
+    const std::vector<Ray> rays = getBenchmarkRays(nPrimary);
 
-        int pixelX = 0;
-        int pixelY = 0;
+    size_t nTriangles = 0;
+    for (const tinyobj::shape_t& shape : scene.worldData.shapes) nTriangles += shape.mesh.indices.size() / 3;
+    std::cout << "\nAccelerator benchmark (" << nTriangles << " triangles, " << nPrimary << " primary and "
+              << rays.size() - nPrimary << " bounce rays, " << pool->size() << " threads)" << std::endl;
 
-        for(pixelX = 0; pixelX < scene.config.width; pixelX++) {
-            for(pixelY = 0; pixelY < scene.config.height; pixelY++) {
-                if(pixelX % 10 == 0) {
-                //    cout << "X: " << pixelX << "    " << "Y: " << pixelY << endl;
+    // Every builder is traced through the binary tree and the collapsed 4- and 8-wide trees (full precision
+    // and quantized), with closest-hit and any-hit queries on all rays, and closest-hit queries on the primary
+    // rays one by one and in packets. Speedups are relative to the binary midpoint tree.
+    const char* names[EAccelBuilders] = {"midpoint", "sah", "sbvh", "lbvh"};
+    const struct {
+        uint32_t width;
+        bool quantized;
+    } layouts[] = {{2, false}, {4, false}, {4, true}, {8, false}, {8, true}};
+    float baseline[4] = {};
+    size_t baselineHits[4] = {};
+    for (int builder = 0; builder < EAccelBuilders; builder++) {
+        BVHBuildSettings settings = AcceleratorBVH::getSettings(scene.config, EAccelBuilder(builder));
+        settings.width = 2;
+        AcceleratorBVH accel(scene.worldData, settings, scene.bvh->instances);
+        const auto begin = std::chrono::steady_clock::now();
+        accel.build(pool.get());
+        const std::chrono::duration<float> build = std::chrono::steady_clock::now() - begin;
+        std::cout << "  " << std::setw(8) << names[builder] << ": built in " << build.count() << "s, ";
+        if (accel.top)
+            std::cout << accel.instances.size() << " instances of " << accel.meshes.size() << " shapes, ";
+        else
+            std::cout << accel.bvh->nodeCount() << " nodes, " << accel.bvh->leafCount() << " leaves, "
+                      << accel.triangles.size() << " triangle references, SAH cost "
+                      << BVHBuilder::sahCost(*accel.bvh, settings.intersectionCost) << ", ";
+        std::cout << float(accel.memoryUsage()) / float(1 << 20) << " MB" << std::endl;
+
+        for (const auto& layout : layouts) {
+            if (layout.quantized && settings.leafSize > 255) continue;
+            accel.settings.width = layout.width;
+            accel.settings.quantized = layout.quantized;
+            accel.collapse();
+            auto closest = [&](size_t begin, size_t end) {
+                size_t n = 0;
+                for (size_t i = begin; i < end; i++) {
+                    SurfaceInteraction hit;
+                    n += accel.intersect(rays[i], hit);
+                }
+                return n;
+            };
+            auto anyHit = [&](size_t begin, size_t end) {
+                size_t n = 0;
+                for (size_t i = begin; i < end; i++) n += accel.occluded(rays[i]);
+                return n;
+            };
+            auto packets = [&](size_t begin, size_t end) {
+                size_t n = 0;
+                SurfaceInteraction hits[AcceleratorBVH::PacketSize];
+                bool found[AcceleratorBVH::PacketSize];
+                for (size_t i = begin; i < end; i += AcceleratorBVH::PacketSize) {
+                    const int count = int(std::min(end - i, size_t(AcceleratorBVH::PacketSize)));
+                    accel.intersect(&rays[i], count, hits, found);
+                    n += std::count(found, found + count, true);
                 }
+                return n;
+            };
+            size_t hits[4];
+            const float time[4] = {traceBenchmark(rays.size(), closest, hits[0]),
+                                   traceBenchmark(rays.size(), anyHit, hits[1]),
+                                   traceBenchmark(nPrimary, closest, hits[2]),
+                                   traceBenchmark(nPrimary, packets, hits[3])};
+            if (builder == 0 && layout.width == 2) {
+                std::copy(time, time + 4, baseline);
+                std::copy(hits, hits + 4, baselineHits);
+                baseline[3] = baseline[2];
+                baselineHits[3] = baselineHits[2];
+            }
+            auto print = [&](const char* name, int q, size_t count) {
+                std::cout << name << time[q] << "s (" << float(count) / time[q] * 1e-6f << " Mrays/s, x"
+                          << baseline[q] / time[q] << ")";
+                if (hits[q] != baselineHits[q])
+                    std::cout << " [" << hits[q] << " hits instead of " << baselineHits[q] << "]";
+            };
+            std::cout << "     " << (layout.quantized ? "q" : " ") << "bvh" << layout.width << ": ";
+            print("closest hit ", 0, rays.size());
+            print(", any hit ", 1, rays.size());
+            print(", primary ", 2, nPrimary);
+            print(", primary packets ", 3, nPrimary);
+            std::cout << ", " << float(accel.memoryUsage()) / float(1 << 20) << " MB" << std::endl;
+        }
+    }
+}
 
-                v3f colors = v3f(0.0f);
-                int i;
-                for(i = 0; i < scene.config.spp; i++){  //anti-aliasing component - implementation of A1 bonus
-                    float randomX = sampler.next();
-                    float randomY = sampler2.next();
-                    float pixelNDCX = (pixelX + randomX) / (float) scene.config.width;  //[0, 1]
-                    float pixelNDCY = (pixelY + randomY) / (float) scene.config.height; //[0, 1]
-                    float pixelScreenX = 2 * pixelNDCX - 1;     //[-1, 1]
-                    float pixelScreenY = 1 - 2 * pixelNDCY;     //[-1, 1]
-                    float pixelCameraX = (pixelScreenX) * aspectRatio * scale; //[-aspectRatio*scale, aspectRatio*scale]
-                    float pixelCameraY = (pixelScreenY) * scale;    //[-scale, scale]
-                    v3f dir = v3f(pixelCameraX, pixelCameraY, -1.f);
-                    v4f direction = glm::normalize(v4f(dir, 0.f) * inverseView);
-                    Ray ray = Ray(scene.config.camera.o, direction);
-                    v3f color = integrator->render(ray, sampler);
-                    colors += color;
+/**
+ * Traces the benchmark rays through the tree of the selected builder with every node layout, for the
+ * binary and collapsed trees. Speedups are relative to the depth-first layout of the same tree.
+ */
+void Renderer::benchmarkLayouts() {
+    size_t nPrimary;
+    const std::vector<Ray> rays = getBenchmarkRays(nPrimary);
+    std::cout << "\nBVH layout benchmark (" << nPrimary << " primary and " << rays.size() - nPrimary
+              << " bounce rays, " << pool->size() << " threads)" << std::endl;
+
+    // Area ordering rewrites the binary tree, so it comes last
+    const char* names[EBVHLayouts] = {"depthfirst", "breadthfirst", "veb", "area"};
+    const struct {
+        uint32_t width;
+        bool quantized;
+    } trees[] = {{2, false}, {4, false}, {4, true}, {8, false}, {8, true}};
+    for (const auto& tree : trees) {
+        BVHBuildSettings settings = AcceleratorBVH::getSettings(scene.config);
+        if (tree.quantized && settings.leafSize > 255) continue;
+        settings.width = tree.width;
+        settings.quantized = tree.quantized;
+        settings.layout = EDepthFirstLayout;
+        AcceleratorBVH accel(scene.worldData, settings, scene.bvh->instances);
+        accel.build(pool.get());
+        std::cout << "  " << (tree.quantized ? "q" : " ") << "bvh" << tree.width << std::endl;
+
+        float baseline[2] = {};
+        size_t baselineHits[2] = {};
+        for (int layout = 0; layout < EBVHLayouts; layout++) {
+            accel.settings.layout = EBVHLayout(layout);
+            accel.collapse();
+            auto closest = [&](size_t begin, size_t end) {
+                size_t n = 0;
+                for (size_t i = begin; i < end; i++) {
+                    SurfaceInteraction hit;
+                    n += accel.intersect(rays[i], hit);
                 }
-                integrator->rgb->data[scene.config.width * pixelY + pixelX] = (colors / (float) scene.config.spp);
+                return n;
+            };
+            auto anyHit = [&](size_t begin, size_t end) {
+                size_t n = 0;
+                for (size_t i = begin; i < end; i++) n += accel.occluded(rays[i]);
+                return n;
+            };
+            size_t hits[2];
+            const float time[2] = {traceBenchmark(rays.size(), closest, hits[0]),
+                                   traceBenchmark(rays.size(), anyHit, hits[1])};
+            if (layout == EDepthFirstLayout) {
+                std::copy(time, time + 2, baseline);
+                std::copy(hits, hits + 2, baselineHits);
             }
+            std::cout << "    " << std::setw(12) << names[layout] << ": closest hit " << time[0] << "s (x"
+                      << baseline[0] / time[0] << "), any hit " << time[1] << "s (x" << baseline[1] / time[1] << ")";
+            if (hits[0] != baselineHits[0] || hits[1] != baselineHits[1])
+                std::cout << " [" << hits[0] << " and " << hits[1] << " hits instead of " << baselineHits[0]
+                          << " and " << baselineHits[1] << "]";
+            std::cout << std::endl;
         }
     }
 }
 
+/**
+ * JSON string literal.
+ */
+static std::string jsonString(const std::string& s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) quoted += tfm::format("\\u%04x", int(c));
+        else quoted += c;
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Writes the BVH report to config.bvhStatsFile, one file per animation frame: the settings and the quality of
+ * the trees and, after a render, the average traversal work per ray of its closest-hit and occlusion queries
+ * (null unless compiled with TR_BVH_STATS).
+ */
+void Renderer::writeBVHStats(bool traversal) const {
+    const Config& config = scene.config;
+    const std::string path = getBVHStatsPath();
+    std::ofstream out(path);
+    if (!out) {
+        std::cout << "Could not write the BVH statistics " << path << std::endl;
+        return;
+    }
+    const char* builders[EAccelBuilders] = {"midpoint", "sah", "sbvh", "lbvh"};
+    const char* layouts[EBVHLayouts] = {"depthfirst", "breadthfirst", "veb", "area"};
+    out << "{\n";
+    out << "  \"scene\": " << jsonString(config.tomlFile.string()) << ",\n";
+    if (config.frame >= 0) out << "  \"frame\": " << config.frame << ",\n";
+    out << "  \"builder\": \"" << builders[config.accel] << "\",\n";
+    out << "  \"layout\": \"" << layouts[config.bvhLayout] << "\",\n";
+    out << "  \"accelerator\": ";
+    scene.bvh->writeStats(out, "  ");
+    out << ",\n  \"traversal\": ";
+    if (traversal && BVHStats::enabled) {
+        const BVHCounters c = BVHStats::total();
+        const char* queries[2] = {"closestHit", "occlusion"};
+        out << "{";
+        for (int q = 0; q < 2; q++) {
+            const double rays = double(std::max(c.rays[q], uint64_t(1)));
+            out << (q ? ",\n" : "\n") << "    \"" << queries[q] << "\": {\n";
+            out << "      \"rays\": " << c.rays[q] << ",\n";
+            out << "      \"nodesPerRay\": " << double(c.nodes[q]) / rays << ",\n";
+            out << "      \"trianglesPerRay\": " << double(c.triangles[q]) / rays << "\n";
+            out << "    }";
+        }
+        out << "\n  }";
+    } else {
+        out << "null";
+    }
+    out << "\n}\n";
+    if (!out) std::cout << "Could not write the BVH statistics " << path << std::endl;
+}
 
 /**
  * Post-rendering step.
@@ -187,6 +911,7 @@ void Renderer::cleanUp() {
     if (realTime) {
         renderpass->cleanUp();
     } else {
+        writer->finish();
         integrator->cleanUp();
     }
 }
@@ -195,15 +920,54 @@ BSDF::BSDF(const WorldData& d, const Config& c, const size_t matID) : worldData(
     emission = glm::make_vec3(worldData.materials[matID].emission);
 }
 
-Scene::Scene(const Config& config) : config(config) { }
+Scene::Scene(const Config& config, std::shared_ptr<SceneGeometry> geometry) :
+    config(config), geometry(geometry ? geometry : std::make_shared<SceneGeometry>()),
+    worldData(this->geometry->worldData) { }
 
-bool Scene::load(bool isRealTime) {
+/**
+ * OBJ file of a scene, relative paths start from the scene file directory.
+ */
+fs::path SceneGeometry::getPath(const Config& config) {
     fs::path file(config.objFile);
-    bool ret = false;
-    std::string err;
-
     if (!file.is_absolute())
         file = (config.tomlFile.parent_path() / file).make_preferred();
+    return file;
+}
+
+/**
+ * Identifies geometry that can be shared: same OBJ file, instances and BVH settings.
+ */
+std::string SceneGeometry::getKey(const Config& config) {
+    Hasher instances;
+    for (const ShapeInstance& s : config.instances) {
+        instances.add(s.shape);
+        instances.add(s.toWorld);
+    }
+    return tfm::format("%s|%d|%d|%d|%f|%f|%d|%d|%d|%x", fs::absolute(getPath(config)).string(), config.accel,
+                       config.bvhLeafSize, config.bvhBins, config.bvhLeafCost, config.bvhSplitBudget,
+                       config.bvhWidth, config.bvhQuantized, config.bvhLayout, instances.value);
+}
+
+/**
+ * Fingerprint of the content of a file (0 if it cannot be read).
+ */
+static uint64_t hashFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return 0;
+    Hasher h;
+    std::vector<char> buffer(1 << 20);
+    while (in) {
+        in.read(buffer.data(), std::streamsize(buffer.size()));
+        h.add(buffer.data(), size_t(in.gcount()));
+    }
+    return h.value;
+}
+
+bool SceneGeometry::load(const Config& config) {
+    const fs::path path = getPath(config);
+    fs::path file(path);
+    bool ret = false;
+    std::string err;
 
     tinyobj::attrib_t* attrib_ = &worldData.attrib;
     std::vector<tinyobj::shape_t>* shapes_ = &worldData.shapes;
@@ -215,9 +979,141 @@ bool Scene::load(bool isRealTime) {
 
     if (!err.empty()) { std::cout << "Error: " << err.c_str() << std::endl; }
     if (!ret) {
-        std::cout << "Failed to load scene " << config.objFile << " " << std::endl;
+        std::cout << "Failed to load scene " << path << " " << std::endl;
+        return false;
+    }
+
+    // Instances: every shape in place, then the copies of the scene file
+    std::vector<AcceleratorBVH::Instance> instances;
+    if (!config.instances.empty()) {
+        for (size_t i = 0; i < worldData.shapes.size(); i++)
+            instances.push_back(AcceleratorBVH::Instance{uint32_t(i), mat4f(1.f), mat4f(1.f)});
+    }
+    for (const ShapeInstance& s : config.instances) {
+        size_t i = 0;
+        while (i < worldData.shapes.size() && worldData.shapes[i].name != s.shape) i++;
+        if (i == worldData.shapes.size()) {
+            std::cout << "Error: no shape named " << s.shape << " to instance" << std::endl;
+            return false;
+        }
+        for (int matID : worldData.shapes[i].mesh.material_ids) {
+            const float* e = matID >= 0 ? worldData.materials[matID].emission : nullptr;
+            if (e && (e[0] > 0.f || e[1] > 0.f || e[2] > 0.f)) {
+                std::cout << "Error: emitter " << s.shape << " cannot be instanced" << std::endl;
+                return false;
+            }
+        }
+        instances.push_back(AcceleratorBVH::Instance{uint32_t(i), s.toWorld, glm::inverse(s.toWorld)});
+    }
+
+    // Build BVH, or map the one cached next to the OBJ file for the same content and settings
+    // (instanced geometry is not cached)
+    bvh = std::unique_ptr<TinyRender::AcceleratorBVH>(
+        new TinyRender::AcceleratorBVH(this->worldData, AcceleratorBVH::getSettings(config), std::move(instances)));
+    computeBounds();
+
+    const auto beginBVH = std::chrono::steady_clock::now();
+    const std::string cachePath = bvh->getCachePath(path.string());
+    const bool useCache = config.bvhCache && config.instances.empty();
+    uint64_t geometryHash = 0;
+    if (useCache) {
+        geometryHash = hashFile(filename_);
+        if (bvh->load(cachePath, geometryHash)) {
+            const std::chrono::duration<float> loadTime = std::chrono::steady_clock::now() - beginBVH;
+            std::cout << "BVH loaded from " << cachePath << " in " << loadTime.count() << "s" << std::endl;
+            return true;
+        }
+    }
+
+    ThreadPool pool(ThreadPool::getThreadCount(config.threads));
+    bvh->build(&pool);
+    const std::chrono::duration<float> buildTime = std::chrono::steady_clock::now() - beginBVH;
+    std::cout << "BVH built in " << buildTime.count() << "s on " << pool.size() << " threads";
+    if (!bvh->instances.empty()) std::cout << " (two levels, " << bvh->instances.size() << " instances)";
+    std::cout << std::endl;
+    if (useCache && !bvh->save(cachePath, geometryHash))
+        std::cout << "Could not write the BVH cache " << cachePath << std::endl;
+
+    return true;
+}
+
+bool SceneGeometry::loadFrame(const Config& config, ThreadPool* pool) {
+    const fs::path path = getPath(config);
+    fs::path file(path);
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string err;
+    const std::string filename = file.string();
+    const std::string mtlBasedir = file.make_preferred().parent_path().string();
+    const bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filename.c_str(), mtlBasedir.c_str(), true);
+    if (!err.empty()) { std::cout << "Error: " << err.c_str() << std::endl; }
+    if (!ret) {
+        std::cout << "Failed to load frame " << path << " " << std::endl;
+        return false;
+    }
+
+    bool same = attrib.vertices.size() == worldData.attrib.vertices.size() &&
+                attrib.normals.size() == worldData.attrib.normals.size() && shapes.size() == worldData.shapes.size();
+    for (size_t i = 0; same && i < shapes.size(); i++)
+        same = shapes[i].mesh.indices.size() == worldData.shapes[i].mesh.indices.size();
+    if (!same) {
+        std::cout << "Error: the triangles of " << path << " differ from the previous frame" << std::endl;
+        return false;
+    }
+    worldData.attrib.vertices.swap(attrib.vertices);
+    worldData.attrib.normals.swap(attrib.normals);
+    computeBounds();
+
+    const auto begin = std::chrono::steady_clock::now();
+    const bool rebuilt = bvh->refit(pool, config.rebuildThreshold);
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cout << "BVH " << (rebuilt ? "rebuilt" : "refit") << " in " << elapsed.count() << "s" << std::endl;
+    return true;
+}
+
+/**
+ * Shape centers and bounds, and scene bounds (including the instances).
+ */
+void SceneGeometry::computeBounds() {
+    aabb.reset();
+    worldData.shapesCenter.resize(worldData.shapes.size());
+    worldData.shapesAABOX.resize(worldData.shapes.size());
+    for (size_t i = 0; i < worldData.shapes.size(); i++) {
+        const tinyobj::shape_t& shape = worldData.shapes[i];
+        worldData.shapesCenter[i] = v3f(0.0);
+        worldData.shapesAABOX[i].reset();
+        for (auto idx: shape.mesh.indices) {
+            v3f p = {worldData.attrib.vertices[3 * idx.vertex_index + 0],
+                     worldData.attrib.vertices[3 * idx.vertex_index + 1],
+                     worldData.attrib.vertices[3 * idx.vertex_index + 2]};
+            worldData.shapesCenter[i] += p;
+            worldData.shapesAABOX[i].expandBy(p);
+            aabb.expandBy(p);
+        }
+        worldData.shapesCenter[i] /= float(shape.mesh.indices.size());
+    }
+
+    if (!bvh) return;
+    for (const AcceleratorBVH::Instance& instance : bvh->instances) {
+        const AABB& box = worldData.shapesAABOX[instance.shapeID];
+        for (int c = 0; c < 8; c++) {
+            const v3f corner(c & 1 ? box.max.x : box.min.x, c & 2 ? box.max.y : box.min.y,
+                             c & 4 ? box.max.z : box.min.z);
+            aabb.expandBy(v3f(instance.toWorld * v4f(corner, 1.f)));
+        }
+    }
+}
+
+bool Scene::load(bool isRealTime) {
+    if (geometry->bvh) {
+        std::cout << "Reusing the geometry of " << config.objFile << std::endl;
+    }
+    else if (!geometry->load(config)) {
         return false;
     }
+    bvh = geometry->bvh.get();
+    aabb = geometry->aabb;
 
     // Build list of BSDFs
     bsdfs = std::vector<std::unique_ptr<BSDF>>(worldData.materials.size());
@@ -233,8 +1129,6 @@ bool Scene::load(bool isRealTime) {
     // Build list of emitters (and print what has been loaded)
     std::string nbShapes = worldData.shapes.size() > 1 ? " shapes" : " shape";
     std::cout << "Found " << worldData.shapes.size() << nbShapes << std::endl;
-    worldData.shapesCenter.resize(worldData.shapes.size());
-    worldData.shapesAABOX.resize(worldData.shapes.size());
 
     for (size_t i = 0; i < worldData.shapes.size(); i++) {
         const tinyobj::shape_t& shape = worldData.shapes[i];
@@ -250,27 +1144,8 @@ bool Scene::load(bool isRealTime) {
         } else {
             std::cout << bsdf->toString() << "]" << std::endl;
         }
-
-        // Build world AABB and shape centers
-        worldData.shapesCenter[i] = v3f(0.0);
-        for (auto idx: shape.mesh.indices) {
-            v3f p = {worldData.attrib.vertices[3 * idx.vertex_index + 0],
-                     worldData.attrib.vertices[3 * idx.vertex_index + 1],
-                     worldData.attrib.vertices[3 * idx.vertex_index + 2]};
-            worldData.shapesCenter[i] += p;
-            worldData.shapesAABOX[i].expandBy(p);
-            aabb.expandBy(p);
-        }
-        worldData.shapesCenter[i] /= float(shape.mesh.indices.size());
     }
 
-    // Build BVH
-    bvh = std::unique_ptr<TinyRender::AcceleratorBVH>(new TinyRender::AcceleratorBVH(this->worldData));
-
-    const clock_t beginBVH = clock();
-    bvh->build();
-    std::cout << "BVH built in " << float(clock() - beginBVH) / CLOCKS_PER_SEC << "s" << std::endl;
-
     return true;
 }
 
@@ -356,4 +1231,31 @@ int Scene::getMaterialID(size_t objectIdx, int primID) const {
     return worldData.shapes[objectIdx].mesh.material_ids[primID];
 }
 
+/**
+ * Fingerprint of the loaded geometry and materials.
+ */
+uint64_t Scene::getHash() const {
+    Hasher h;
+    h.add(worldData.attrib.vertices);
+    h.add(worldData.attrib.normals);
+    h.add(worldData.attrib.texcoords);
+    for (const tinyobj::shape_t& shape : worldData.shapes) {
+        h.add(shape.mesh.indices);
+        h.add(shape.mesh.material_ids);
+    }
+    for (const tinyobj::material_t& m : worldData.materials) {
+        h.add(m.diffuse);
+        h.add(m.specular);
+        h.add(m.emission);
+        h.add(m.shininess);
+        h.add(m.illum);
+        h.add(m.diffuse_texname);
+    }
+    for (const ShapeInstance& s : config.instances) {
+        h.add(s.shape);
+        h.add(s.toWorld);
+    }
+    return h.value;
+}
+
 TR_NAMESPACE_END
@@ -11,9 +11,34 @@
 #include <core/core.h>
 #include <core/integrator.h>
 #include <core/renderpass.h>
+#include <core/parallel.h>
 
 TR_NAMESPACE_BEGIN
 
+/**
+ * Image tile, covers pixels [x0, x1) x [y0, y1).
+ */
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+/**
+ * Snapshot of an offline render, enough to resume it exactly.
+ * Sampler streams are indexed by pixel and sample, so the per-pixel sample counts
+ * are also the positions in the sampler streams.
+ */
+struct RenderState {
+    uint64_t configHash, sceneHash;
+    int width, height, pass;
+    uint64_t samples;
+    std::vector<v3f> accum, accumHalf;
+    std::vector<uint32_t> sampleCounts;
+    std::vector<uint8_t> active;
+
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+};
+
 /**
  * Renderer structure (offline and real-time).
  */
@@ -27,10 +52,50 @@ struct Renderer {
     unsigned int previousTime = 0, currentTime = 0;
     const int frameDuration = 30;
 
-    explicit Renderer(const Config& config);
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<BackgroundWriter> writer;
+    Tile region;                            // Rendered region of the image (crop window)
+    std::vector<Tile> tiles;
+    std::vector<glm::ivec2> pixelOrder;     // Pixel offsets inside a tile, in traversal order
+    mat4f inverseView;
+    float aspectRatio, scale;
+
+    std::unique_ptr<RenderBuffer> accum;    // Sum of the samples of each pixel
+    std::vector<uint32_t> sampleCounts;     // Number of samples accumulated in each pixel
+    std::unique_ptr<RenderBuffer> accumHalf;// Sum of the odd samples of each pixel (adaptive sampling)
+    std::vector<uint8_t> active;            // Whether a pixel still needs samples
+    int passSpp = 0;                        // Samples added to each pixel by the current pass
+    uint64_t samples = 0;                   // Samples taken over all pixels
+    int pass = 0;                           // Number of completed passes
+    bool saveFiles = true;                  // Whether render() writes checkpoints, render state and statistics
+
+    explicit Renderer(const Config& config, std::shared_ptr<SceneGeometry> geometry = nullptr);
     bool init(bool isRealTime, bool nogui);
     void render();
     void cleanUp();
+    void benchmarkTileOrders();
+    void benchmarkAccelerators();
+    void benchmarkLayouts();
+    void writeBVHStats(bool traversal) const;
+
+    /**
+     * Offline rendering helpers.
+     */
+    void initCamera();
+    Ray generateRay(float x, float y) const;
+    std::vector<Ray> getBenchmarkRays(size_t& nPrimary);
+    float traceBenchmark(size_t count, const std::function<size_t(size_t, size_t)>& query, size_t& hits);
+    void renderTile(size_t tileID);
+    size_t updateConvergence();
+    void resolve(RenderBuffer& image) const;
+    std::vector<EXRMetadata> getMetadata() const;
+    std::vector<EXRChannel> getChannels() const;
+    void checkpoint();
+    uint64_t getConfigHash() const;
+    std::string getStatePath() const;
+    std::string getBVHStatsPath() const;
+    RenderState getState() const;
+    bool resume();
 };
 
 TR_NAMESPACE_END
\ No newline at end of file
@@ -89,17 +89,35 @@ inline bool saveEXR(const GLfloat* pixels, const std::string& filename, const in
     return true;
 }
 
+/**
+ * Integer-valued attribute stored in the .exr header (int, v2i or box2i).
+ */
+struct EXRMetadata {
+    std::string name, type;
+    std::vector<int> values;
+};
+
+/**
+ * Extra single-channel layer saved along RGB (stored in full float precision).
+ * EXR channel lists are sorted by name, so the name must sort after "R" (e.g., lowercase).
+ */
+struct EXRChannel {
+    std::string name;
+    std::vector<float> data;
+};
+
 /**
  * Saves render buffer to .exr image file.
  */
-inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filename, const int width, const int height) {
+inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filename, const int width, const int height,
+                    const std::vector<EXRMetadata>& metadata = {}, const std::vector<EXRChannel>& channels = {}) {
     EXRHeader header;
     InitEXRHeader(&header);
 
     EXRImage image;
     InitEXRImage(&image);
 
-    image.num_channels = 3;
+    image.num_channels = 3 + int(channels.size());
 
     std::vector<float> images[3];
     images[0].resize(width * height);
@@ -113,16 +131,18 @@ inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filena
         images[2][i] = rgb[i].z;
     }
 
-    float* image_ptr[3];
+    std::vector<float*> image_ptr(size_t(image.num_channels));
     image_ptr[0] = &(images[2].at(0)); // B
     image_ptr[1] = &(images[1].at(0)); // G
     image_ptr[2] = &(images[0].at(0)); // R
+    for (size_t c = 0; c < channels.size(); c++)
+        image_ptr[3 + c] = const_cast<float*>(channels[c].data.data());
 
-    image.images = (unsigned char**) image_ptr;
+    image.images = (unsigned char**) image_ptr.data();
     image.width = width;
     image.height = height;
 
-    header.num_channels = 3;
+    header.num_channels = image.num_channels;
     header.channels = (EXRChannelInfo*) malloc(sizeof(EXRChannelInfo) * header.num_channels);
 
     // Must be (A)BGR order, since most of EXR viewers expect this channel order
@@ -132,29 +152,349 @@ inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filena
     header.channels[1].name[strlen("G")] = '\0';
     strncpy(header.channels[2].name, "R", 255);
     header.channels[2].name[strlen("R")] = '\0';
+    for (size_t c = 0; c < channels.size(); c++) {
+        strncpy(header.channels[3 + c].name, channels[c].name.c_str(), 255);
+        header.channels[3 + c].name[255] = '\0';
+    }
 
     header.pixel_types = (int*) malloc(sizeof(int) * header.num_channels);
     header.requested_pixel_types = (int*) malloc(sizeof(int) * header.num_channels);
     for (int i = 0; i < header.num_channels; i++) {
         header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF;
+        header.requested_pixel_types[i] = i < 3 ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT;
+    }
+
+    // Custom attributes, values are written as is (EXR is little-endian)
+    std::vector<EXRAttribute> attributes(metadata.size());
+    for (size_t i = 0; i < metadata.size(); i++) {
+        strncpy(attributes[i].name, metadata[i].name.c_str(), 255);
+        attributes[i].name[255] = '\0';
+        strncpy(attributes[i].type, metadata[i].type.c_str(), 255);
+        attributes[i].type[255] = '\0';
+        attributes[i].value = (unsigned char*) metadata[i].values.data();
+        attributes[i].size = int(sizeof(int) * metadata[i].values.size());
     }
+    header.num_custom_attributes = int(attributes.size());
+    header.custom_attributes = attributes.empty() ? nullptr : attributes.data();
 
     const char* err = nullptr;
     int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
+    free(header.channels);
+    free(header.pixel_types);
+    free(header.requested_pixel_types);
     if (ret != TINYEXR_SUCCESS) {
         fprintf(stderr, "Save EXR err: %s\n", err);
         FreeEXRErrorMessage(err);
         return false;
     }
     std::cout << "\nSaved EXR image to " << filename << std::endl;
+    return true;
+}
 
-    free(header.channels);
-    free(header.pixel_types);
-    free(header.requested_pixel_types);
+/**
+ * Image loaded from an .exr file: float channels and integer-valued header attributes.
+ */
+struct EXRImageData {
+    int width = 0, height = 0;
+    std::vector<EXRChannel> channels;
+    std::vector<EXRMetadata> metadata;
+
+    const EXRChannel* getChannel(const std::string& name) const {
+        for (const EXRChannel& c : channels)
+            if (c.name == name) return &c;
+        return nullptr;
+    }
+    const EXRMetadata* getMetadata(const std::string& name) const {
+        for (const EXRMetadata& m : metadata)
+            if (m.name == name) return &m;
+        return nullptr;
+    }
+};
+
+/**
+ * Loads a scanline .exr image file, channels are converted to float.
+ */
+inline bool loadEXR(const std::string& filename, EXRImageData& data) {
+    EXRVersion version;
+    if (ParseEXRVersionFromFile(&version, filename.c_str()) != TINYEXR_SUCCESS) {
+        fprintf(stderr, "Load EXR err: invalid file %s\n", filename.c_str());
+        return false;
+    }
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    const char* err = nullptr;
+    if (ParseEXRHeaderFromFile(&header, &version, filename.c_str(), &err) != TINYEXR_SUCCESS) {
+        fprintf(stderr, "Load EXR err: %s\n", err);
+        FreeEXRErrorMessage(err);
+        return false;
+    }
+    for (int i = 0; i < header.num_channels; i++)
+        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
+
+    EXRImage image;
+    InitEXRImage(&image);
+    if (LoadEXRImageFromFile(&image, &header, filename.c_str(), &err) != TINYEXR_SUCCESS) {
+        fprintf(stderr, "Load EXR err: %s\n", err);
+        FreeEXRErrorMessage(err);
+        FreeEXRHeader(&header);
+        return false;
+    }
+
+    data.width = image.width;
+    data.height = image.height;
+    data.channels.resize(size_t(header.num_channels));
+    for (int c = 0; c < header.num_channels; c++) {
+        const float* values = (const float*) image.images[c];
+        data.channels[c].name = header.channels[c].name;
+        data.channels[c].data.assign(values, values + size_t(image.width) * image.height);
+    }
+    data.metadata.clear();
+    for (int i = 0; i < header.num_custom_attributes; i++) {
+        const EXRAttribute& a = header.custom_attributes[i];
+        const std::string type(a.type);
+        if (type != "int" && type != "v2i" && type != "box2i") continue;
+        std::vector<int> values(size_t(a.size) / sizeof(int));
+        if (!values.empty()) memcpy(values.data(), a.value, sizeof(int) * values.size());
+        data.metadata.push_back(EXRMetadata{a.name, type, values});
+    }
+
+    FreeEXRImage(&image);
+    FreeEXRHeader(&header);
     return true;
 }
 
+/**
+ * Assembles images rendered with a crop window into the full image.
+ * Each input carries its window ("cropWindow", inclusive box2i) and the full image size ("fullSize").
+ * Fails if parts overlap or leave pixels of the full image uncovered.
+ */
+inline bool mergeEXR(const std::vector<std::string>& inputs, const std::string& output) {
+    int width = 0, height = 0;
+    std::unique_ptr<v3f[]> rgb;
+    std::vector<float> counts;
+    std::vector<uint8_t> covered;
+    bool hasCounts = true;
+
+    for (const std::string& input : inputs) {
+        EXRImageData part;
+        if (!loadEXR(input, part)) return false;
+        const EXRMetadata* window = part.getMetadata("cropWindow");
+        const EXRMetadata* fullSize = part.getMetadata("fullSize");
+        const EXRChannel* r = part.getChannel("R");
+        const EXRChannel* g = part.getChannel("G");
+        const EXRChannel* b = part.getChannel("B");
+        if (!window || !fullSize || window->values.size() != 4 || fullSize->values.size() != 2 || !r || !g || !b) {
+            fprintf(stderr, "Merge EXR err: %s is not a cropped render\n", input.c_str());
+            return false;
+        }
+        if (fullSize->values[0] <= 0 || fullSize->values[1] <= 0) {
+            fprintf(stderr, "Merge EXR err: %s has an invalid full size %dx%d\n", input.c_str(), fullSize->values[0],
+                    fullSize->values[1]);
+            return false;
+        }
+
+        if (!rgb) {
+            width = fullSize->values[0];
+            height = fullSize->values[1];
+            rgb = std::unique_ptr<v3f[]>(new v3f[size_t(width) * height]);
+            std::fill(rgb.get(), rgb.get() + size_t(width) * height, v3f(0.f));
+            counts.assign(size_t(width) * height, 0.f);
+            covered.assign(size_t(width) * height, 0);
+        }
+        const int x0 = window->values[0], y0 = window->values[1];
+        if (fullSize->values[0] != width || fullSize->values[1] != height || x0 < 0 || y0 < 0 ||
+            x0 + part.width > width || y0 + part.height > height) {
+            fprintf(stderr, "Merge EXR err: %s does not fit a %dx%d image\n", input.c_str(), width, height);
+            return false;
+        }
+        for (int y = 0; y < part.height; y++) {
+            for (int x = 0; x < part.width; x++) {
+                if (covered[size_t(y0 + y) * width + (x0 + x)]) {
+                    fprintf(stderr, "Merge EXR err: %s overlaps another partial image\n", input.c_str());
+                    return false;
+                }
+            }
+        }
+
+        const EXRChannel* sampleCounts = part.getChannel("sampleCount");
+        hasCounts = hasCounts && sampleCounts;
+        for (int y = 0; y < part.height; y++) {
+            for (int x = 0; x < part.width; x++) {
+                const size_t src = size_t(y) * part.width + x;
+                const size_t dst = size_t(y0 + y) * width + (x0 + x);
+                rgb[dst] = v3f(r->data[src], g->data[src], b->data[src]);
+                if (sampleCounts) counts[dst] = sampleCounts->data[src];
+                covered[dst] = 1;
+            }
+        }
+    }
+    if (!rgb) return false;
+
+    const size_t missing = size_t(std::count(covered.begin(), covered.end(), uint8_t(0)));
+    if (missing > 0) {
+        fprintf(stderr, "Merge EXR err: the partial images leave %zu of %zu pixels uncovered\n", missing,
+                size_t(width) * height);
+        return false;
+    }
+
+    std::vector<EXRChannel> channels;
+    if (hasCounts) channels.push_back(EXRChannel{"sampleCount", counts});
+    return saveEXR(rgb, output, width, height, {}, channels);
+}
+
+/**
+ * Allocator aligning arrays to a given boundary (e.g. 64 bytes for cache lines).
+ */
+template<class T, size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+    template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() = default;
+    template<class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = nullptr;
+#endif
+        if (!p && n > 0) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+    template<class U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template<class U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+/**
+ * Aligned array owning its elements, or viewing elements owned by someone else (e.g. a memory-mapped file,
+ * kept alive by the array). Resizing a view copies it first.
+ */
+template<class T, size_t Alignment = 64>
+struct AlignedArray {
+    typedef std::vector<T, AlignedAllocator<T, Alignment>> Vector;
+
+    AlignedArray() = default;
+    explicit AlignedArray(Vector&& v) : owned(std::move(v)), ptr(owned.data()), n(owned.size()) { }
+    AlignedArray(AlignedArray&&) = default;
+    AlignedArray& operator=(AlignedArray&&) = default;
+
+    /**
+     * View of n elements at data, which must stay valid as long as owner is alive.
+     */
+    static AlignedArray view(T* data, size_t n, std::shared_ptr<void> owner) {
+        AlignedArray a;
+        a.ptr = data;
+        a.n = n;
+        a.owner = std::move(owner);
+        return a;
+    }
+
+    void resize(size_t size) {
+        if (owner) owned.assign(ptr, ptr + n);
+        owned.resize(size);
+        *this = AlignedArray(std::move(owned));
+    }
+    template<class It>
+    void assign(It first, It last) { *this = AlignedArray(Vector(first, last)); }
+    void clear() { *this = AlignedArray(); }
+
+    bool isView() const { return bool(owner); }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    T* data() { return ptr; }
+    const T* data() const { return ptr; }
+    T* begin() { return ptr; }
+    T* end() { return ptr + n; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + n; }
+    T& operator[](size_t i) { return ptr[i]; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+
+  private:
+    Vector owned;
+    T* ptr = nullptr;
+    size_t n = 0;
+    std::shared_ptr<void> owner;
+};
+
+/**
+ * Traversal stack of at most size entries: an array on the call stack when it fits in Fixed entries, otherwise
+ * a per-thread buffer kept between queries, so that traversal stops allocating once the buffers fit the deepest
+ * tree. Nested traversals (two-level BVH) get one buffer per nesting level.
+ */
+template<class T, size_t Fixed>
+struct TraversalStack {
+    explicit TraversalStack(size_t size) {
+        if (size <= Fixed) return;
+        level = int(nesting()++);
+        std::vector<std::vector<T>>& buffers = threadBuffers();
+        if (buffers.size() <= size_t(level)) buffers.resize(size_t(level) + 1);
+        if (buffers[level].size() < size) buffers[level].resize(size);
+        data = buffers[level].data();
+    }
+
+    ~TraversalStack() {
+        if (level >= 0) nesting()--;
+    }
+
+    TraversalStack(const TraversalStack&) = delete;
+    TraversalStack& operator=(const TraversalStack&) = delete;
+
+    T& operator[](int i) { return data[i]; }
+
+  private:
+    T fixed[Fixed];
+    T* data = fixed;
+    int level = -1;     // Nesting level of the per-thread buffer in use, if any
+
+    static size_t& nesting() {
+        static thread_local size_t depth = 0;
+        return depth;
+    }
+
+    static std::vector<std::vector<T>>& threadBuffers() {
+        static thread_local std::vector<std::vector<T>> buffers;
+        return buffers;
+    }
+};
+
+/**
+ * Incremental 64-bit FNV-1a hash, used to fingerprint scenes and settings.
+ */
+struct Hasher {
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    void add(const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*) data;
+        for (size_t i = 0; i < size; i++)
+            value = (value ^ bytes[i]) * 0x100000001b3ull;
+    }
+    template<class T>
+    void add(const T& pod) { add(&pod, sizeof(T)); }
+    template<class T>
+    void add(const std::vector<T>& pods) {
+        add(pods.size());
+        if (!pods.empty()) add(pods.data(), sizeof(T) * pods.size());
+    }
+    void add(const std::string& s) {
+        add(s.size());
+        add(s.data(), s.size());
+    }
+};
+
 /**
  * Variadic template constructor to support printf-style arguments.
  */
@@ -0,0 +1,653 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include "core.h"
+#include "parallel.h"
+#include "bvhstats.h"
+#include "bvh.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TR_SSE
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#define TR_AVX
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Ray prepared for slab tests: reciprocal direction and, per axis, the bounds row of the near and far planes.
+ */
+struct WideRay {
+    float o[3], inv[3];
+    uint32_t nearRow[3], farRow[3];
+    float tmin;
+
+    // Widens exit distances by a few ulps, so that rounding never culls a box the ray grazes
+    static constexpr float farScale = 1.0000004f;
+
+    WideRay() = default;
+    explicit WideRay(const Ray& ray) : tmin(ray.min_t) {
+        for (int a = 0; a < 3; a++) {
+            o[a] = ray.o[a];
+            // Keep the reciprocal finite so that box tests never produce NaNs
+            const float d = std::fabs(ray.d[a]) < 1e-20f ? std::copysign(1e-20f, ray.d[a]) : ray.d[a];
+            inv[a] = 1.f / d;
+            nearRow[a] = inv[a] >= 0.f ? a : a + 3;
+            farRow[a] = inv[a] >= 0.f ? a + 3 : a;
+        }
+    }
+};
+
+/**
+ * Node of an N-wide BVH with the child bounds stored as structure of arrays.
+ * Rows are min x, y, z then max x, y, z. Unused slots have inverted (empty) bounds and are never hit.
+ */
+template<int N>
+struct alignas(64) WideBVHNode {
+    float bounds[6][N];
+    uint32_t child[N];      // Inner child: node index, leaf child: first primitive in leaf order
+    uint32_t count[N];      // Primitives of a leaf child, 0 for an inner child (0 and 0: unused slot)
+
+    bool isInner(int i) const { return count[i] == 0 && child[i] != 0; }
+
+    /**
+     * Half the surface area of a child.
+     */
+    float childArea(int i) const {
+        const v3f e(bounds[3][i] - bounds[0][i], bounds[4][i] - bounds[1][i], bounds[5][i] - bounds[2][i]);
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    /**
+     * Slab tests against all children of a node, within [r.tmin, tmax].
+     * Returns the mask of the children hit and writes their entry distances to tNear.
+     */
+    static int intersect(const WideBVHNode& node, const WideRay& r, float tmax, float* tNear) {
+        int mask = 0;
+        for (int i = 0; i < N; i++) {
+            float t0 = r.tmin, t1 = tmax;
+            for (int a = 0; a < 3; a++) {
+                t0 = std::max(t0, (node.bounds[r.nearRow[a]][i] - r.o[a]) * r.inv[a]);
+                t1 = std::min(t1, (node.bounds[r.farRow[a]][i] - r.o[a]) * r.inv[a]);
+            }
+            tNear[i] = t0;
+            if (t0 <= t1 * WideRay::farScale) mask |= 1 << i;
+        }
+        return mask;
+    }
+};
+
+/**
+ * Compressed node of an N-wide BVH: child bounds are stored with 8 bits per plane, on a grid spanning
+ * the node bounds. Grid steps are powers of two, so decoded planes (origin + q * step) are computed
+ * exactly as at encoding time, where they were rounded outwards: decoded boxes always contain the
+ * original ones. A 4-wide node fits in one cache line instead of two.
+ */
+template<int N>
+struct alignas(64) QuantizedBVHNode {
+    float origin[3];        // Grid origin, the minimum corner of the node
+    int8_t exponent[3];     // Grid step 2^exponent per axis
+    uint8_t used;           // Mask of the children in use
+    uint8_t count[N];       // Primitives of a leaf child, 0 for an inner child
+    uint8_t bounds[6][N];   // Grid coordinates, rows are min x, y, z then max x, y, z
+    uint32_t child[N];      // Inner child: node index, leaf child: first primitive in leaf order
+
+    QuantizedBVHNode() = default;
+
+    explicit QuantizedBVHNode(const WideBVHNode<N>& node) {
+        used = 0;
+        for (int i = 0; i < N; i++) {
+            if (node.count[i] > 255)
+                throw std::runtime_error("Quantized BVH nodes hold leaves of at most 255 primitives");
+            if (node.count[i] > 0 || node.child[i] != 0) used |= 1 << i;
+            child[i] = node.child[i];
+            count[i] = uint8_t(node.count[i]);
+        }
+        for (int a = 0; a < 3; a++) {
+            float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+            for (int i = 0; i < N; i++) {
+                if (!(used & (1 << i))) continue;
+                lo = std::min(lo, node.bounds[a][i]);
+                hi = std::max(hi, node.bounds[a + 3][i]);
+            }
+            origin[a] = lo;
+
+            // Smallest step covering the node extent in 255 steps
+            int e = -126;
+            if (hi > lo) e = std::max(e, int(std::ceil(std::log2((hi - lo) / 255.f))));
+            while (e < 127 && decode(lo, e, 255) < hi) e++;
+            exponent[a] = int8_t(std::min(e, 127));
+
+            for (int i = 0; i < N; i++) {
+                int qlo = 0, qhi = 0;
+                if (used & (1 << i)) {
+                    const float step = getStep(exponent[a]);
+                    qlo = std::min(std::max(int(std::floor((node.bounds[a][i] - lo) / step)), 0), 255);
+                    qhi = std::min(std::max(int(std::ceil((node.bounds[a + 3][i] - lo) / step)), 0), 255);
+                    while (qlo > 0 && decode(lo, exponent[a], qlo) > node.bounds[a][i]) qlo--;
+                    while (qhi < 255 && decode(lo, exponent[a], qhi) < node.bounds[a + 3][i]) qhi++;
+                }
+                bounds[a][i] = uint8_t(qlo);
+                bounds[a + 3][i] = uint8_t(qhi);
+            }
+        }
+    }
+
+    /**
+     * Power of two 2^e, for e in [-126, 127].
+     */
+    static float getStep(int e) {
+        const uint32_t bits = uint32_t(e + 127) << 23;
+        float step;
+        std::memcpy(&step, &bits, sizeof(float));
+        return step;
+    }
+
+    static float decode(float origin, int e, int q) { return origin + float(q) * getStep(e); }
+
+    bool isInner(int i) const { return count[i] == 0 && (used & (1 << i)); }
+
+    float childArea(int i) const {
+        float e[3];
+        for (int a = 0; a < 3; a++) e[a] = float(bounds[a + 3][i] - bounds[a][i]) * getStep(exponent[a]);
+        return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+    }
+
+    /**
+     * Slab tests against the decoded bounds of all children, see WideBVHNode::intersect.
+     */
+    static int intersect(const QuantizedBVHNode& node, const WideRay& r, float tmax, float* tNear) {
+        int mask = 0;
+        for (int i = 0; i < N; i++) {
+            float t0 = r.tmin, t1 = tmax;
+            for (int a = 0; a < 3; a++) {
+                const float step = getStep(node.exponent[a]);
+                const float near = node.origin[a] + float(node.bounds[r.nearRow[a]][i]) * step;
+                const float far = node.origin[a] + float(node.bounds[r.farRow[a]][i]) * step;
+                t0 = std::max(t0, (near - r.o[a]) * r.inv[a]);
+                t1 = std::min(t1, (far - r.o[a]) * r.inv[a]);
+            }
+            tNear[i] = t0;
+            if (t0 <= t1 * WideRay::farScale) mask |= 1 << i;
+        }
+        return mask & node.used;
+    }
+};
+
+/**
+ * BVH with N children per node (N = 4 or 8), collapsed from a binary BVH, with full precision
+ * or quantized nodes. Nodes test all their children at once with SSE (N = 4) or AVX (N = 8) when
+ * the compiler targets them, with a scalar fallback otherwise. Leaves are the leaves of the binary
+ * tree, so primitives keep its leaf order.
+ */
+template<int N, class Node = WideBVHNode<N>>
+struct WideBVH {
+    AlignedArray<Node> nodes;
+    uint32_t maxDepth = 0;
+    uint32_t stackSize = 1;     // Traversal stack entries needed: every level leaves at most N - 1 siblings
+
+    /**
+     * Adopts nodes collapsed earlier (e.g. mapped from a cache file).
+     */
+    WideBVH(AlignedArray<Node> nodes, uint32_t maxDepth)
+        : nodes(std::move(nodes)), maxDepth(maxDepth), stackSize((maxDepth + 1) * (N - 1) + 1) { }
+
+    /**
+     * Collapses the binary tree: every node adopts the grandchildren of its largest inner children
+     * (by surface area) until it has N children or only leaves left.
+     */
+    explicit WideBVH(const BVH& bvh) {
+        const AlignedArray<BVHFlatNode>& tree = bvh.flatTree;
+        if (tree.empty()) return;
+
+        struct Entry {
+            uint32_t binary, wide, depth;
+        };
+        std::vector<Entry> todo;
+        typename AlignedArray<Node>::Vector built(1);
+        todo.push_back(Entry{0, 0, 0});
+        while (!todo.empty()) {
+            const Entry e = todo.back();
+            todo.pop_back();
+            maxDepth = std::max(maxDepth, e.depth);
+
+            // Children in the binary tree, a leaf root becomes the only child
+            uint32_t children[N];
+            int n = 0;
+            const BVHFlatNode& root = tree[e.binary];
+            if (root.rightOffset == 0) {
+                children[n++] = e.binary;
+            } else {
+                children[n++] = e.binary + 1;
+                children[n++] = e.binary + root.rightOffset;
+            }
+            while (n < N) {
+                int best = -1;
+                float bestArea = -1.f;
+                for (int i = 0; i < n; i++) {
+                    const BVHFlatNode& c = tree[children[i]];
+                    if (c.rightOffset != 0 && c.bbox.surfaceArea() > bestArea) {
+                        best = i;
+                        bestArea = c.bbox.surfaceArea();
+                    }
+                }
+                if (best < 0) break;
+                const uint32_t split = children[best];
+                children[best] = split + 1;
+                children[n++] = split + tree[split].rightOffset;
+            }
+
+            // Fill the node, inner children get their own node, visited depth-first
+            WideBVHNode<N> node;
+            for (int i = 0; i < N; i++) {
+                const bool used = i < n;
+                const BBox& b = tree[children[used ? i : 0]].bbox;
+                for (int a = 0; a < 3; a++) {
+                    node.bounds[a][i] = used ? b.min[a] : std::numeric_limits<float>::infinity();
+                    node.bounds[a + 3][i] = used ? b.max[a] : -std::numeric_limits<float>::infinity();
+                }
+                node.child[i] = 0;
+                node.count[i] = 0;
+            }
+            for (int i = 0; i < n; i++) {
+                const BVHFlatNode& c = tree[children[i]];
+                if (c.rightOffset == 0) {
+                    node.child[i] = c.start;
+                    node.count[i] = c.nPrims;
+                } else {
+                    node.child[i] = uint32_t(built.size());
+                    built.emplace_back();
+                }
+            }
+            for (int i = n - 1; i >= 0; i--)
+                if (node.count[i] == 0)
+                    todo.push_back(Entry{children[i], node.child[i], e.depth + 1});
+            built[e.wide] = Node(node);
+        }
+        nodes = AlignedArray<Node>(std::move(built));
+        stackSize = (maxDepth + 1) * (N - 1) + 1;
+    }
+
+    /**
+     * Reorders the nodes in memory, the root stays first. Nodes are collapsed depth-first with the
+     * children of a node next to each other, other layouts are:
+     * - breadth-first: level by level, the top levels visited by most rays are packed together;
+     * - van Emde Boas: the top half of the levels, then every subtree below it, laid out recursively
+     *   the same way, so that subtrees of any size are contiguous (cache-oblivious);
+     * - area: depth-first, inner children by decreasing surface area, so that the child most likely
+     *   to be visited follows its parent.
+     */
+    void relayout(EBVHLayout layout) {
+        if (nodes.empty() || layout == EDepthFirstLayout) return;
+        std::vector<uint32_t> order;
+        order.reserve(nodes.size());
+        if (layout == EBreadthFirstLayout) {
+            order.push_back(0);
+            for (size_t k = 0; k < order.size(); k++) {
+                const Node& node = nodes[order[k]];
+                for (int i = 0; i < N; i++)
+                    if (node.isInner(i)) order.push_back(node.child[i]);
+            }
+        } else if (layout == EVanEmdeBoasLayout) {
+            layoutVEB(0, maxDepth + 1, order);
+        } else {
+            std::vector<uint32_t> todo(1, 0);
+            while (!todo.empty()) {
+                const uint32_t id = todo.back();
+                todo.pop_back();
+                order.push_back(id);
+                const Node& node = nodes[id];
+                int children[N], n = 0;
+                for (int i = 0; i < N; i++) {
+                    if (!node.isInner(i)) continue;
+                    int j = n++;
+                    for (; j > 0 && node.childArea(children[j - 1]) > node.childArea(i); j--)
+                        children[j] = children[j - 1];
+                    children[j] = i;
+                }
+                for (int i = 0; i < n; i++) todo.push_back(node.child[children[i]]);
+            }
+        }
+
+        std::vector<uint32_t> position(nodes.size());
+        for (size_t k = 0; k < order.size(); k++) position[order[k]] = uint32_t(k);
+        typename AlignedArray<Node>::Vector reordered(nodes.size());
+        for (size_t k = 0; k < order.size(); k++) {
+            Node& node = reordered[k] = nodes[order[k]];
+            for (int i = 0; i < N; i++)
+                if (node.isInner(i)) node.child[i] = position[node.child[i]];
+        }
+        nodes = AlignedArray<Node>(std::move(reordered));
+    }
+
+    uint32_t nodeCount() const { return uint32_t(nodes.size()); }
+
+    /**
+     * Same traversal contract as BVH::getIntersection: intersect(i, t) tests the primitive at
+     * position i in leaf order and returns true, updating t, if it is hit closer than t.
+     * Only children overlapping [ray.min_t, t] are visited, front to back. Occlusion queries return on the first hit.
+     */
+    template<class Intersect>
+    bool getIntersection(const Ray& ray, float& t, const Intersect& intersect, bool occlusion) const {
+        if (nodes.empty()) return false;
+        const WideRay r(ray);
+
+        struct StackEntry {
+            uint32_t child, count;
+            float tNear;
+        };
+        TraversalStack<StackEntry, 256> todo(stackSize);
+        int stackptr = 0;
+        todo[0] = StackEntry{0, 0, ray.min_t};
+
+        bool found = false;
+        while (stackptr >= 0) {
+            const StackEntry e = todo[stackptr--];
+            if (e.tNear > t) continue;
+
+            if (e.count > 0) {
+                for (uint32_t i = e.child; i < e.child + e.count; i++) {
+                    if (intersect(i, t)) {
+                        if (occlusion) return true;
+                        found = true;
+                    }
+                }
+                continue;
+            }
+
+            BVHStats::countNode(occlusion);
+            alignas(32) float tNear[N];
+            const Node& node = nodes[e.child];
+            int mask = Node::intersect(node, r, t, tNear);
+            if (!mask) continue;
+
+            // Sort the children hit by distance, then push them far to near
+            StackEntry hits[N];
+            int n = 0;
+            while (mask) {
+                const int i = ctz(mask);
+                mask &= mask - 1;
+                const StackEntry h{node.child[i], node.count[i], tNear[i]};
+                int j = n++;
+                for (; j > 0 && hits[j - 1].tNear > h.tNear; j--) hits[j] = hits[j - 1];
+                hits[j] = h;
+            }
+            for (int j = n - 1; j >= 0; j--) todo[++stackptr] = hits[j];
+        }
+        return found;
+    }
+
+    /**
+     * Closest-hit query for a packet of coherent rays (ranged traversal).
+     * Every subtree is entered with the range [first, last] between the first and the last ray of the
+     * packet hitting its bounds. Nodes only test rays from either end of the range until one hits each
+     * child, rather than every ray, so coherent rays share node tests. Nodes with leaf children test
+     * every ray of the range, and leaves are then intersected with the rays hitting their bounds only.
+     * A subtree reached by a single ray is traversed as with a single ray. intersect(k, i, t) tests
+     * primitive i against ray k, updating t (the closest hit distance of ray k, initially the end of
+     * its interval) as in getIntersection.
+     */
+    template<class Intersect>
+    void getIntersections(const Ray* rays, int count, float* t, const Intersect& intersect) const {
+        if (nodes.empty() || count <= 0) return;
+        WideRay r[MaxPacketSize];
+        for (int k = 0; k < count; k++) r[k] = WideRay(rays[k]);
+
+        struct StackEntry {
+            uint32_t child, count;
+            int first, last;
+            uint32_t rays;      // Rays hitting a leaf
+        };
+        TraversalStack<StackEntry, 256> todo(stackSize);
+        int stackptr = 0;
+        todo[0] = StackEntry{0, 0, 0, count - 1, 0};
+
+        while (stackptr >= 0) {
+            const StackEntry e = todo[stackptr--];
+
+            if (e.count > 0) {
+                for (uint32_t m = e.rays; m; m &= m - 1) {
+                    const int k = ctz(int(m));
+                    for (uint32_t i = e.child; i < e.child + e.count; i++)
+                        intersect(k, i, t[k]);
+                }
+                continue;
+            }
+
+            BVHStats::countNode(false);
+            const Node& node = nodes[e.child];
+            int valid = 0, leaves = 0;
+            for (int i = 0; i < N; i++) {
+                if (node.count[i] > 0 || node.child[i] != 0) valid |= 1 << i;
+                if (node.count[i] > 0) leaves |= 1 << i;
+            }
+            alignas(32) float tNear[N];
+            int first[N], last[N];
+            float near[N];
+            uint32_t hitRays[N] = {};
+            int hit = 0;
+
+            if (leaves) {
+                // Every ray of the range against all children
+                for (int k = e.first; k <= e.last; k++) {
+                    const int mask = Node::intersect(node, r[k], t[k], tNear) & valid;
+                    for (int m = mask; m; m &= m - 1) {
+                        const int i = ctz(m);
+                        if (!(hit & (1 << i))) {
+                            first[i] = k;
+                            near[i] = tNear[i];
+                        }
+                        last[i] = k;
+                        hitRays[i] |= 1u << k;
+                    }
+                    hit |= mask;
+                }
+            } else {
+                // First ray hitting each child, with its entry distance
+                int remaining = valid;
+                for (int k = e.first; k <= e.last && remaining; k++) {
+                    const int mask = Node::intersect(node, r[k], t[k], tNear) & remaining;
+                    remaining &= ~mask;
+                    for (int m = mask; m; m &= m - 1) {
+                        const int i = ctz(m);
+                        first[i] = k;
+                        near[i] = tNear[i];
+                    }
+                }
+                hit = valid & ~remaining;
+
+                // Last ray hitting each child, scanning back to its first ray at most
+                remaining = hit;
+                for (int k = e.last; remaining; k--) {
+                    int mask = 0;
+                    for (int m = remaining; m; m &= m - 1)
+                        if (first[ctz(m)] == k) mask |= m & -m;
+                    if (mask != remaining) mask |= Node::intersect(node, r[k], t[k], tNear) & remaining;
+                    for (int m = mask; m; m &= m - 1) last[ctz(m)] = k;
+                    remaining &= ~mask;
+                }
+            }
+            if (!hit) continue;
+
+            // Push the children hit far to near, by the entry distance of their first ray
+            StackEntry hits[N];
+            float hitNear[N];
+            int n = 0;
+            for (int m = hit; m; m &= m - 1) {
+                const int i = ctz(m);
+                int j = n++;
+                for (; j > 0 && hitNear[j - 1] > near[i]; j--) {
+                    hits[j] = hits[j - 1];
+                    hitNear[j] = hitNear[j - 1];
+                }
+                hits[j] = StackEntry{node.child[i], node.count[i], first[i], last[i], hitRays[i]};
+                hitNear[j] = near[i];
+            }
+            for (int j = n - 1; j >= 0; j--) todo[++stackptr] = hits[j];
+        }
+    }
+
+    static const int MaxPacketSize = 16;
+
+  private:
+    /**
+     * Appends the nodes of the first levels of the subtree of a node to order, in van Emde Boas order.
+     */
+    void layoutVEB(uint32_t id, uint32_t levels, std::vector<uint32_t>& order) const {
+        if (levels <= 1) {
+            order.push_back(id);
+            return;
+        }
+        const uint32_t top = levels / 2;
+        layoutVEB(id, top, order);
+        std::vector<uint32_t> roots(1, id), next;
+        for (uint32_t level = 0; level < top; level++) {
+            next.clear();
+            for (uint32_t r : roots)
+                for (int i = 0; i < N; i++)
+                    if (nodes[r].isInner(i)) next.push_back(nodes[r].child[i]);
+            roots.swap(next);
+        }
+        for (uint32_t r : roots) layoutVEB(r, levels - top, order);
+    }
+
+    static int ctz(int mask) {
+#if defined(_MSC_VER)
+        unsigned long i;
+        _BitScanForward(&i, unsigned(mask));
+        return int(i);
+#else
+        return __builtin_ctz(unsigned(mask));
+#endif
+    }
+};
+
+#ifdef TR_SSE
+template<>
+inline int WideBVHNode<4>::intersect(const WideBVHNode<4>& node, const WideRay& r, float tmax, float* tNear) {
+    __m128 t0 = _mm_set1_ps(r.tmin), t1 = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m128 o = _mm_set1_ps(r.o[a]), inv = _mm_set1_ps(r.inv[a]);
+        t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.nearRow[a]]), o), inv));
+        t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.farRow[a]]), o), inv));
+    }
+    _mm_store_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(WideRay::farScale))));
+}
+
+/**
+ * Decodes four quantized planes, origin + q * step.
+ */
+inline __m128 decodeQuantized4(const uint8_t* q, __m128 origin, __m128 step) {
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(packed));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(v), step));
+}
+
+template<>
+inline int QuantizedBVHNode<4>::intersect(const QuantizedBVHNode<4>& node, const WideRay& r, float tmax, float* tNear) {
+    __m128 t0 = _mm_set1_ps(r.tmin), t1 = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m128 origin = _mm_set1_ps(node.origin[a]), step = _mm_set1_ps(getStep(node.exponent[a]));
+        const __m128 o = _mm_set1_ps(r.o[a]), inv = _mm_set1_ps(r.inv[a]);
+        t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(decodeQuantized4(node.bounds[r.nearRow[a]], origin, step), o), inv));
+        t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(decodeQuantized4(node.bounds[r.farRow[a]], origin, step), o), inv));
+    }
+    _mm_store_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(WideRay::farScale)))) & node.used;
+}
+#endif
+
+#if defined(TR_AVX)
+template<>
+inline int WideBVHNode<8>::intersect(const WideBVHNode<8>& node, const WideRay& r, float tmax, float* tNear) {
+    __m256 t0 = _mm256_set1_ps(r.tmin), t1 = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m256 o = _mm256_set1_ps(r.o[a]), inv = _mm256_set1_ps(r.inv[a]);
+        t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.nearRow[a]]), o), inv));
+        t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.farRow[a]]), o), inv));
+    }
+    _mm256_store_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(WideRay::farScale)), _CMP_LE_OQ));
+}
+
+/**
+ * Decodes eight quantized planes, origin + q * step.
+ */
+inline __m256 decodeQuantized8(const uint8_t* q, __m256 origin, __m256 step) {
+    const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q));
+#if defined(__AVX2__)
+    const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(packed));
+#else
+    const __m128i zero = _mm_setzero_si128(), v16 = _mm_unpacklo_epi8(packed, zero);
+    const __m256 v = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero))),
+                                          _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero)), 1);
+#endif
+    return _mm256_add_ps(origin, _mm256_mul_ps(v, step));
+}
+
+template<>
+inline int QuantizedBVHNode<8>::intersect(const QuantizedBVHNode<8>& node, const WideRay& r, float tmax, float* tNear) {
+    __m256 t0 = _mm256_set1_ps(r.tmin), t1 = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m256 origin = _mm256_set1_ps(node.origin[a]), step = _mm256_set1_ps(getStep(node.exponent[a]));
+        const __m256 o = _mm256_set1_ps(r.o[a]), inv = _mm256_set1_ps(r.inv[a]);
+        t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(decodeQuantized8(node.bounds[r.nearRow[a]], origin, step), o), inv));
+        t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(decodeQuantized8(node.bounds[r.farRow[a]], origin, step), o), inv));
+    }
+    _mm256_store_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(WideRay::farScale)), _CMP_LE_OQ)) & node.used;
+}
+#elif defined(TR_SSE)
+template<>
+inline int WideBVHNode<8>::intersect(const WideBVHNode<8>& node, const WideRay& r, float tmax, float* tNear) {
+    // Two halves of four children
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4) {
+        __m128 t0 = _mm_set1_ps(r.tmin), t1 = _mm_set1_ps(tmax);
+        for (int a = 0; a < 3; a++) {
+            const __m128 o = _mm_set1_ps(r.o[a]), inv = _mm_set1_ps(r.inv[a]);
+            t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.nearRow[a]] + h), o), inv));
+            t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.farRow[a]] + h), o), inv));
+        }
+        _mm_store_ps(tNear + h, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(WideRay::farScale)))) << h;
+    }
+    return mask;
+}
+
+template<>
+inline int QuantizedBVHNode<8>::intersect(const QuantizedBVHNode<8>& node, const WideRay& r, float tmax, float* tNear) {
+    // Two halves of four children
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4) {
+        __m128 t0 = _mm_set1_ps(r.tmin), t1 = _mm_set1_ps(tmax);
+        for (int a = 0; a < 3; a++) {
+            const __m128 origin = _mm_set1_ps(node.origin[a]), step = _mm_set1_ps(getStep(node.exponent[a]));
+            const __m128 o = _mm_set1_ps(r.o[a]), inv = _mm_set1_ps(r.inv[a]);
+            t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(decodeQuantized4(node.bounds[r.nearRow[a]] + h, origin, step), o), inv));
+            t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(decodeQuantized4(node.bounds[r.farRow[a]] + h, origin, step), o), inv));
+        }
+        _mm_store_ps(tNear + h, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(WideRay::farScale)))) << h;
+    }
+    return mask & node.used;
+}
+#endif
+
+TR_NAMESPACE_END
@@ -16,12 +16,16 @@ TR_NAMESPACE_BEGIN
  * Surface normal integrator.
  */
 struct NormalIntegrator : Integrator {
-    explicit NormalIntegrator(const Scene& scene) : Integrator(scene) { }
+    explicit NormalIntegrator(const Scene& scene) : Integrator(scene) { usesPrimaryHits = true; }
 
     v3f render(const Ray& ray, Sampler& sampler) const override {
         SurfaceInteraction hit = SurfaceInteraction();
+        const bool found = scene.bvh->intersect(ray, hit);
+        return renderPrimary(ray, sampler, hit, found);
+    }
 
-        if(scene.bvh->intersect(ray, hit)) {
+    v3f renderPrimary(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit, bool found) const override {
+        if(found) {
             v3f color(hit.frameNs.n);
             return abs(color);
         }
@@ -18,6 +18,7 @@ struct PathTracerIntegrator : Integrator {
         m_maxDepth = scene.config.integratorSettings.pt.maxDepth;   //maximum path depth
         m_rrDepth = scene.config.integratorSettings.pt.rrDepth; //Russian roulette probability (e.g. 0.95 means a 95% chance of recursion)
         m_rrProb = scene.config.integratorSettings.pt.rrProb;   //Path depth at which Russian roulette path termination is employed
+        usesPrimaryHits = true;
     }
 
 
@@ -92,7 +93,6 @@ struct PathTracerIntegrator : Integrator {
     v3f renderExplicit(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit) const {
         v3f Li(0.f);
 
-        SurfaceInteraction sInfo;
         SurfaceInteraction tempSI;
         tempSI.t = 0.0f;
         tempSI.u = 0.1f;
@@ -119,7 +119,6 @@ struct PathTracerIntegrator : Integrator {
             float pdf;
             const Emitter &emitter = getEmitterByID(selectEmitter(sampler.next(), emitterPdf));
 
-            float tempPdf = 0.0f;
             v3f emPos;
 
             p2f sigmas = sampler.next2D();
@@ -131,23 +130,19 @@ struct PathTracerIntegrator : Integrator {
 
             hit.wi = normalize(hit.frameNs.toLocal(wiWFrame));
 
+            // Visibility only: the shadow ray stops just before the sampled emitter point
             Ray shadowRay = Ray(hit.p, wiWFrame, Epsilon);
-            if (scene.bvh->intersect(shadowRay, sInfo)) {
-                v3f emission = getEmission(sInfo);
-                if (length(emission) != 0) {
-                    v3f BRDFselected = getBSDF(hit)->eval(hit);
-
-                    float cosTheta0 = glm::dot(-wiWFrame, emNormal);
-                    if (cosTheta0 < 0) {
-                        cosTheta0 = 0;
-                    }
-                    float distance_2 = glm::length2(emPos - hit.p);
-                    float jacobianTerm = cosTheta0 / distance_2;
-                    Li += emission * BRDFselected * totalBRDF * jacobianTerm / (pdf * emitterPdf);
-                } else {
-                    tempPdf += 1.0f;
-                    Li += v3f(0.f);
+            if (!scene.bvh->occluded(shadowRay, glm::length(emPos - hit.p) * (1.f - 1e-4f))) {
+                v3f emission = emitter.getRadiance();
+                v3f BRDFselected = getBSDF(hit)->eval(hit);
+
+                float cosTheta0 = glm::dot(-wiWFrame, emNormal);
+                if (cosTheta0 < 0) {
+                    cosTheta0 = 0;
                 }
+                float distance_2 = glm::length2(emPos - hit.p);
+                float jacobianTerm = cosTheta0 / distance_2;
+                Li += emission * BRDFselected * totalBRDF * jacobianTerm / (pdf * emitterPdf);
             }
 
             pdf = 0;
@@ -183,8 +178,12 @@ struct PathTracerIntegrator : Integrator {
     v3f render(const Ray& ray, Sampler& sampler) const override {
         Ray r = ray;
         SurfaceInteraction hit;
+        const bool found = scene.bvh->intersect(r, hit);
+        return renderPrimary(ray, sampler, hit, found);
+    }
 
-        if (scene.bvh->intersect(r, hit)) {
+    v3f renderPrimary(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit, bool found) const override {
+        if (found) {
             if (m_isExplicit)
                 return this->renderExplicit(ray, sampler, hit);
             else
@@ -8,6 +8,10 @@
 #include <core/core.h>
 #include <core/platform.h>
 #include <core/renderer.h>
+#include <core/distributed.h>
+#include <chrono>
+#include <fstream>
+#include <map>
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 #define TINYOBJLOADER_IMPLEMENTATION
@@ -25,6 +29,22 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
     const auto input = data->get_table("input");
     config.objFile = *input->get_as<std::string>("objfile");
 
+    // Animation: one OBJ file per frame, with the same triangles, named by a printf pattern (e.g. "mesh/walk_%03d.obj")
+    if (const auto animation = data->get_table("animation")) {
+        const auto frames = animation->get_as<std::string>("frames");
+        if (!frames || frames->find('%') == std::string::npos) {
+            throw std::runtime_error("Animation without a frame file pattern");
+        }
+        config.frames = *frames;
+        config.firstFrame = animation->get_as<int>("first").value_or(0);
+        config.lastFrame = animation->get_as<int>("last").value_or(config.firstFrame);
+        config.rebuildThreshold = animation->get_as<double>("rebuildThreshold").value_or(0.);
+        if (config.lastFrame < config.firstFrame || config.rebuildThreshold < 0.f) {
+            throw std::runtime_error("Invalid animation frame range or rebuild threshold");
+        }
+        config.objFile = tfm::format(config.frames.c_str(), config.firstFrame);
+    }
+
     // Camera settings
     const auto camera = data->get_table("camera");
     config.camera.fov = camera->get_as<double>("fov").value_or(30.);
@@ -35,6 +55,34 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
     auto up = camera->get_array_of<double>("up").value_or({0., 1., 0.});
     config.camera.up = v3f(up[0], up[1], up[2]);
 
+    // Shape instances: [[instance]] tables with the shape name, then scale, rotation (degrees around x,
+    // then y, then z) and translation
+    if (const auto instances = data->get_table_array("instance")) {
+        for (const auto& instance : *instances) {
+            TinyRender::ShapeInstance s;
+            const auto shape = instance->get_as<std::string>("shape");
+            if (!shape) {
+                throw std::runtime_error("Instance without a shape name");
+            }
+            s.shape = *shape;
+            auto scale = instance->get_array_of<double>("scale").value_or({1., 1., 1.});
+            auto rotate = instance->get_array_of<double>("rotate").value_or({0., 0., 0.});
+            auto translate = instance->get_array_of<double>("translate").value_or({0., 0., 0.});
+            if (scale.size() != 3 || rotate.size() != 3 || translate.size() != 3) {
+                throw std::runtime_error("Invalid instance transform (3 values per vector)");
+            }
+            s.toWorld = glm::translate(mat4f(1.f), v3f(translate[0], translate[1], translate[2]));
+            s.toWorld = glm::rotate(s.toWorld, float(rotate[2] * deg2rad), v3f(0.f, 0.f, 1.f));
+            s.toWorld = glm::rotate(s.toWorld, float(rotate[1] * deg2rad), v3f(0.f, 1.f, 0.f));
+            s.toWorld = glm::rotate(s.toWorld, float(rotate[0] * deg2rad), v3f(1.f, 0.f, 0.f));
+            s.toWorld = glm::scale(s.toWorld, v3f(scale[0], scale[1], scale[2]));
+            if (glm::determinant(s.toWorld) == 0.f) {
+                throw std::runtime_error("Invalid instance transform (zero scale)");
+            }
+            config.instances.push_back(s);
+        }
+    }
+
     // Film settings
     const auto film = data->get_table("film");
     config.width = film->get_as<int>("width").value_or(768);
@@ -100,53 +148,414 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
             throw std::runtime_error("Invalid integrator type");
         }
 
-        config.spp = renderer->get_as<int>("spp").value_or(1);
+        config.timeLimit = renderer->get_as<double>("timeLimit").value_or(0.);
+        config.spp = renderer->get_as<int>("spp").value_or(0);
+        config.noiseThreshold = renderer->get_as<double>("noiseThreshold").value_or(0.);
+        config.minSpp = renderer->get_as<int>("minSpp").value_or(8);
+        config.sampleCountLayer = renderer->get_as<bool>("sampleCountLayer").value_or(false);
+        config.saveState = renderer->get_as<bool>("saveState").value_or(false);
+        config.threads = renderer->get_as<int>("threads").value_or(0);
+        config.tileSize = renderer->get_as<int>("tileSize").value_or(32);
+        auto tileOrder = renderer->get_as<std::string>("tileOrder").value_or("scanline");
+        if (tileOrder == "scanline") {
+            config.tileOrder = TinyRender::EScanlineOrder;
+        }
+        else if (tileOrder == "morton") {
+            config.tileOrder = TinyRender::EMortonOrder;
+        }
+        else if (tileOrder == "hilbert") {
+            config.tileOrder = TinyRender::EHilbertOrder;
+        }
+        else {
+            throw std::runtime_error("Invalid tile order");
+        }
+        config.seed = renderer->get_as<int>("seed").value_or(260631195);
+        config.passSpp = renderer->get_as<int>("passSpp").value_or(0);
+        config.checkpointPasses = renderer->get_as<int>("checkpointPasses").value_or(0);
+        config.checkpointInterval = renderer->get_as<double>("checkpointInterval").value_or(0.);
+
+        // Acceleration structure
+        auto accel = renderer->get_as<std::string>("accel").value_or("sah");
+        if (accel == "midpoint") {
+            config.accel = TinyRender::EMidpointBuilder;
+        }
+        else if (accel == "sah") {
+            config.accel = TinyRender::ESAHBuilder;
+        }
+        else if (accel == "sbvh") {
+            config.accel = TinyRender::ESBVHBuilder;
+        }
+        else if (accel == "lbvh") {
+            config.accel = TinyRender::ELBVHBuilder;
+        }
+        else {
+            throw std::runtime_error("Invalid acceleration structure builder");
+        }
+        config.bvhLeafSize = renderer->get_as<int>("bvhLeafSize").value_or(4);
+        config.bvhBins = renderer->get_as<int>("bvhBins").value_or(16);
+        config.bvhLeafCost = renderer->get_as<double>("bvhLeafCost").value_or(1.);
+        config.bvhSplitBudget = renderer->get_as<double>("bvhSplitBudget").value_or(.25);
+        if (config.bvhSplitBudget < 0.f) {
+            throw std::runtime_error("Invalid spatial split budget (negative)");
+        }
+        config.bvhWidth = renderer->get_as<int>("bvhWidth").value_or(4);
+        if (config.bvhWidth != 2 && config.bvhWidth != 4 && config.bvhWidth != 8) {
+            throw std::runtime_error("Invalid BVH width (2, 4 or 8)");
+        }
+        config.bvhQuantized = renderer->get_as<bool>("bvhQuantized").value_or(false);
+        config.bvhCache = renderer->get_as<bool>("bvhCache").value_or(true);
+        auto layout = renderer->get_as<std::string>("bvhLayout").value_or("depthfirst");
+        if (layout == "depthfirst") {
+            config.bvhLayout = TinyRender::EDepthFirstLayout;
+        }
+        else if (layout == "breadthfirst") {
+            config.bvhLayout = TinyRender::EBreadthFirstLayout;
+        }
+        else if (layout == "veb") {
+            config.bvhLayout = TinyRender::EVanEmdeBoasLayout;
+        }
+        else if (layout == "area") {
+            config.bvhLayout = TinyRender::EAreaLayout;
+        }
+        else {
+            throw std::runtime_error("Invalid BVH layout (depthfirst, breadthfirst, veb or area)");
+        }
+        if (config.bvhQuantized && (config.bvhWidth == 2 || config.bvhLeafSize > 255)) {
+            throw std::runtime_error("Quantized BVH nodes need a width of 4 or 8 and leaves of at most 255 triangles");
+        }
     }
 
     return realTime;
 }
 
+/**
+ * Command-line options, they take precedence over the scene file.
+ */
+struct Options {
+    std::string inputTOMLFile;
+    bool nogui = false;
+    int threads = -1;
+    float timeLimit = -1.f;
+    bool resume = false;
+    bool benchTileOrder = false;
+    bool benchAccel = false;
+    bool benchLayout = false;
+    std::string bvhStats;               // JSON file of the BVH statistics
+    bool crop = false;
+    int cropWindow[4] = {0, 0, 0, 0};   // x0, y0, x1, y1 (x1 and y1 excluded)
+    std::vector<std::string> mergeFiles; // Output file followed by the partial images
+    std::string coordinator;            // Address to listen on for workers
+    int localWorkers = 0;               // Worker processes to start on this machine
+    std::string worker;                 // Coordinator address, when running as a worker
+    std::string executable;
+    std::vector<std::string> args;      // Scene file and options shared with the workers
+    std::vector<std::string> batchFiles; // Scene files, patterns or lists of a batch
+};
+
+/**
+ * Applies the command-line options to a scene configuration.
+ */
+void applyOptions(TinyRender::Config& config, const Options& options, bool isRealTime) {
+    if (options.threads >= 0) config.threads = options.threads;
+    if (options.timeLimit >= 0.f) config.timeLimit = options.timeLimit;
+    config.resume = options.resume;
+    config.bvhStatsFile = options.bvhStats;
+    if (config.resume) config.saveState = true;
+
+    // Rendered region, clamped to the film
+    config.crop[0] = 0;
+    config.crop[1] = 0;
+    config.crop[2] = config.width;
+    config.crop[3] = config.height;
+    if (options.crop && !isRealTime) {
+        const int* w = options.cropWindow;
+        config.crop[0] = TinyRender::clamp(w[0], 0, config.width);
+        config.crop[1] = TinyRender::clamp(w[1], 0, config.height);
+        config.crop[2] = TinyRender::clamp(w[2], config.crop[0], config.width);
+        config.crop[3] = TinyRender::clamp(w[3], config.crop[1], config.height);
+        if (config.crop[2] == config.crop[0] || config.crop[3] == config.crop[1]) {
+            std::cerr << "Error: empty crop window" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        config.isCropped = config.crop[0] > 0 || config.crop[1] > 0 ||
+                           config.crop[2] < config.width || config.crop[3] < config.height;
+    }
+}
+
+/**
+ * Renders the frames of an animated scene, one image each. The geometry is loaded once and its BVH
+ * refit to the vertices of every following frame.
+ */
+void runAnimation(TinyRender::Config& config) {
+    std::shared_ptr<TinyRender::SceneGeometry> geometry;
+    TinyRender::ThreadPool pool(TinyRender::ThreadPool::getThreadCount(config.threads));
+    const auto beginAnimation = std::chrono::steady_clock::now();
+    for (int frame = config.firstFrame; frame <= config.lastFrame; frame++) {
+        config.frame = frame;
+        config.objFile = tfm::format(config.frames.c_str(), frame);
+        std::cout << "\nFrame " << frame << ": " << config.objFile << std::endl;
+        if (geometry && !geometry->loadFrame(config, &pool)) exit(EXIT_FAILURE);
+
+        TinyRender::Renderer renderer(config, geometry);
+        if (!renderer.init(false, true)) exit(EXIT_FAILURE);
+        geometry = renderer.scene.geometry;
+        renderer.render();
+        renderer.cleanUp();
+    }
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - beginAnimation;
+    std::cout << "\nRendered " << config.lastFrame - config.firstFrame + 1 << " frames in " << elapsed.count()
+              << "s" << std::endl;
+}
+
 /**
  * Launch rendering job.
  */
-void run(std::string& inputTOMLFile, bool nogui) {
+void run(const Options& options) {
     TinyRender::Config config;
     bool isRealTime;
 
     try {
-        isRealTime = loadTOML(config, inputTOMLFile);
+        isRealTime = loadTOML(config, options.inputTOMLFile);
     } catch (std::exception const& e) {
         std::cerr << "Error while parsing scene file: " << e.what() << std::endl;
         exit(EXIT_FAILURE);
     }
+    applyOptions(config, options, isRealTime);
+    if (!config.frames.empty() && !isRealTime && !options.benchTileOrder && !options.benchAccel && !options.benchLayout &&
+        options.worker.empty() && options.coordinator.empty() && options.localWorkers == 0) {
+        runAnimation(config);
+        return;
+    }
 
     TinyRender::Renderer renderer(config);
-    renderer.init(isRealTime, nogui);
+    renderer.init(isRealTime, options.nogui);
+    if (options.benchTileOrder && !isRealTime) {
+        renderer.benchmarkTileOrders();
+        return;
+    }
+    if (options.benchAccel && !isRealTime) {
+        renderer.benchmarkAccelerators();
+        return;
+    }
+    if (options.benchLayout && !isRealTime) {
+        renderer.benchmarkLayouts();
+        return;
+    }
+    if (!options.worker.empty() && !isRealTime) {
+        if (!TinyRender::runWorker(renderer, options.worker)) exit(EXIT_FAILURE);
+        return;
+    }
+    if ((!options.coordinator.empty() || options.localWorkers > 0) && !isRealTime) {
+        TinyRender::DistributedOptions distributed;
+        distributed.address = options.coordinator.empty() ? TinyRender::getDefaultCoordinatorAddress() : options.coordinator;
+        distributed.localWorkers = options.localWorkers;
+        distributed.workerThreads = std::max(0, options.threads);
+        distributed.executable = options.executable;
+        distributed.workerArgs = options.args;
+        if (!TinyRender::runCoordinator(renderer, distributed)) exit(EXIT_FAILURE);
+        renderer.cleanUp();
+        return;
+    }
     renderer.render();
     renderer.cleanUp();
 }
 
+/**
+ * Matches a file name against a pattern with '*' (any sequence) and '?' (any character) wildcards.
+ */
+bool matchWildcard(const char* pattern, const char* name) {
+    if (*pattern == '\0') return *name == '\0';
+    if (*pattern == '*') return matchWildcard(pattern + 1, name) || (*name && matchWildcard(pattern, name + 1));
+    return *name && (*pattern == '?' || *pattern == *name) && matchWildcard(pattern + 1, name + 1);
+}
+
+/**
+ * Expands the batch arguments into scene files.
+ * An argument is a scene file, a pattern with wildcards in its file name, or a text file listing scene files
+ * (relative to the list). Returns false if a list could not be read.
+ */
+bool expandBatch(const std::vector<std::string>& args, std::vector<std::string>& files) {
+    bool ok = true;
+    for (const std::string& arg : args) {
+        const fs::path path(arg);
+        const std::string name = path.filename().string();
+        if (name.find_first_of("*?") != std::string::npos) {
+            const fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+            std::vector<std::string> matches;
+            if (fs::is_directory(dir))
+                for (const auto& entry : fs::directory_iterator(dir))
+                    if (matchWildcard(name.c_str(), entry.path().filename().string().c_str()))
+                        matches.push_back(entry.path().string());
+            std::sort(matches.begin(), matches.end());
+            files.insert(files.end(), matches.begin(), matches.end());
+        }
+        else if (path.extension() == ".txt") {
+            std::ifstream list(arg);
+            if (!list) {
+                std::cerr << "Could not read the scene list " << arg << std::endl;
+                ok = false;
+                continue;
+            }
+            std::string line;
+            while (std::getline(list, line)) {
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (line.empty() || line[0] == '#') continue;
+                const fs::path file(line);
+                files.push_back(file.is_absolute() ? line : (path.parent_path() / file).string());
+            }
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+    return ok;
+}
+
+/**
+ * Renders offline jobs back to back in one process.
+ * Jobs rendering the same OBJ file with the same BVH settings share its loaded geometry and BVH,
+ * which is released after the last of them.
+ */
+void runBatch(const Options& options) {
+    std::vector<std::string> files;
+    const bool listed = expandBatch(options.batchFiles, files);
+    std::vector<TinyRender::Config> configs(files.size());
+    std::vector<std::string> keys(files.size());
+    std::vector<bool> valid(files.size(), false);
+    for (size_t i = 0; i < files.size(); i++) {
+        try {
+            if (loadTOML(configs[i], files[i])) {
+                std::cerr << "Skipping real-time scene " << files[i] << std::endl;
+                continue;
+            }
+        } catch (std::exception const& e) {
+            std::cerr << "Error while parsing scene file " << files[i] << ": " << e.what() << std::endl;
+            continue;
+        }
+        applyOptions(configs[i], options, false);
+        keys[i] = TinyRender::SceneGeometry::getKey(configs[i]);
+        valid[i] = true;
+    }
+
+    std::map<std::string, std::shared_ptr<TinyRender::SceneGeometry>> cache;
+    size_t rendered = 0;
+    const auto beginBatch = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!valid[i]) continue;
+        std::cout << "\nJob " << i + 1 << "/" << files.size() << ": " << files[i] << std::endl;
+        {
+            TinyRender::Renderer renderer(configs[i], cache[keys[i]]);
+            if (renderer.init(false, true)) {
+                cache[keys[i]] = renderer.scene.geometry;
+                renderer.render();
+                renderer.cleanUp();
+                rendered++;
+            }
+        }
+        if (std::find(keys.begin() + std::ptrdiff_t(i) + 1, keys.end(), keys[i]) == keys.end())
+            cache.erase(keys[i]);
+    }
+
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - beginBatch;
+    std::cout << "\nRendered " << rendered << " of " << files.size() << " jobs in " << elapsed.count() << "s" << std::endl;
+    if (!listed || rendered != files.size()) exit(EXIT_FAILURE);
+}
+
+/**
+ * Parse command-line arguments.
+ */
+bool parseOptions(int argc, char* argv[], Options& options) {
+    options.executable = argv[0];
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        if (arg == "nogui") {
+            options.nogui = true;
+        }
+        else if ((arg == "--threads" || arg == "-t") && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "--bench-tile-order") {
+            options.benchTileOrder = true;
+        }
+        else if (arg == "--bench-accel") {
+            options.benchAccel = true;
+        }
+        else if (arg == "--bench-layout") {
+            options.benchLayout = true;
+        }
+        else if (arg == "--bvh-stats" && i + 1 < argc) {
+            options.bvhStats = argv[++i];
+        }
+        else if (arg == "--resume") {
+            options.resume = true;
+        }
+        else if (arg == "--time-limit" && i + 1 < argc) {
+            options.timeLimit = float(std::atof(argv[++i]));
+        }
+        else if (arg == "--crop" && i + 1 < argc) {
+            int* w = options.cropWindow;
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &w[0], &w[1], &w[2], &w[3]) != 4) return false;
+            options.crop = true;
+            options.args.insert(options.args.end(), {arg, argv[i]});
+        }
+        else if (arg == "--coordinator" && i + 1 < argc) {
+            options.coordinator = argv[++i];
+        }
+        else if (arg == "--workers" && i + 1 < argc) {
+            options.localWorkers = std::atoi(argv[++i]);
+        }
+        else if (arg == "--worker" && i + 1 < argc) {
+            options.worker = argv[++i];
+        }
+        else if (arg == "--merge" && i + 2 < argc) {
+            options.mergeFiles.assign(argv + i + 1, argv + argc);
+            return true;
+        }
+        else if (arg == "--batch" && i + 1 < argc) {
+            options.batchFiles.assign(argv + i + 1, argv + argc);
+            return true;
+        }
+        else if (options.inputTOMLFile.empty() && arg[0] != '-') {
+            options.inputTOMLFile = arg;
+            options.args.insert(options.args.end(), {arg, "nogui"});
+        }
+        else {
+            return false;
+        }
+    }
+    return !options.inputTOMLFile.empty() || !options.mergeFiles.empty();
+}
+
 /**
  * Main TinyRender program.
  */
 int main(int argc, char* argv[]) {
-    if (argc != 2 && argc !=3) {
-        cerr << "Syntax: " << argv[0] << " <scene.toml>" << endl;
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "Syntax: " << argv[0] << " <scene.toml> [nogui] [--threads N] [--time-limit seconds] [--resume]"
+             << " [--bench-tile-order] [--bench-accel] [--bench-layout] [--bvh-stats file.json] [--crop x0,y0,x1,y1]"
+             << endl;
+        cerr << "        " << argv[0] << " <scene.toml> nogui [--coordinator address] [--workers N] [options]" << endl;
+        cerr << "        " << argv[0] << " <scene.toml> nogui --worker address [--threads N] [--crop x0,y0,x1,y1]" << endl;
+        cerr << "        " << argv[0] << " [options] --batch <scene.toml | pattern | list.txt>..." << endl;
+        cerr << "        " << argv[0] << " --merge <output.exr> <partial.exr>..." << endl;
         exit(EXIT_FAILURE);
     }
 
-    bool nogui = false;
-    if(argc == 3) {
-        if(std::string(argv[2]) == "nogui") {
-            nogui = true;
-        }
+    if (!options.mergeFiles.empty()) {
+        const std::vector<std::string> inputs(options.mergeFiles.begin() + 1, options.mergeFiles.end());
+        return TinyRender::mergeEXR(inputs, options.mergeFiles[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!options.batchFiles.empty()) {
+        runBatch(options);
+        return EXIT_SUCCESS;
     }
 
-    auto inputTOMLFile = std::string(argv[1]);
-    run(inputTOMLFile, nogui);
+    run(options);
 
 #ifdef _WIN32
-    if(!nogui) system("pause");
+    if(!options.nogui) system("pause");
 #endif
 
     return EXIT_SUCCESS;